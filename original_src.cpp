@@ -14,6 +14,10 @@ class DISOpticalFlowImpl CV_FINAL : public DISOpticalFlow
     DISOpticalFlowImpl();
 
     void calc(InputArray I0, InputArray I1, InputOutputArray flow) CV_OVERRIDE;
+    void calc(InputArray I0, InputArray I1, InputOutputArray flow, InputArray roiMask) CV_OVERRIDE;
+    void calcNext(InputArray nextFrame, InputOutputArray flow) CV_OVERRIDE;
+    void calcSparse(InputArray I0, InputArray I1, InputArray points, OutputArray outFlow) CV_OVERRIDE;
+    void calcPatchFlow(InputArray I0, InputArray I1, OutputArray patch_flow, OutputArray patch_ssd) CV_OVERRIDE;
     void metal_calc(InputArray I0, InputArray I1, InputOutputArray flow, void *metal_PatchInverseSearch) CV_OVERRIDE;
 
     void collectGarbage() CV_OVERRIDE;
@@ -23,15 +27,24 @@ class DISOpticalFlowImpl CV_FINAL : public DISOpticalFlow
     int patch_size;
     int patch_stride;
     int grad_descent_iter;
+    vector<int> grad_descent_schedule; //!< gradient descent iterations per level, starting from the finest scale
+    float grad_descent_step_threshold;
+    float texture_threshold; //!< minimum eigenvalue of the structure tensor per patch pixel, 0 to disable pruning
     int variational_refinement_iter;
     float variational_refinement_alpha;
     float variational_refinement_gamma;
     float variational_refinement_delta;
     bool use_mean_normalization;
     bool use_spatial_propagation;
+    int spatial_propagation_mode;
+    bool use_batched_inverse_search; //!< search 4 patches per vector lane group when spatial propagation is off
+    float static_tile_threshold;
+    bool use_temporal_warm_start;
+    double time_budget; //!< per-frame time budget in milliseconds, 0 to disable the anytime mode
+    bool use_adaptive_coarsest_scale;
+    float adaptive_scale_margin;
 
   protected: //!< some auxiliary variables
-    int border_size;
     int w, h;   //!< flow buffer width and height on the current scale
     int ws, hs; //!< sparse flow buffer width and height on the current scale
 
@@ -44,24 +57,71 @@ class DISOpticalFlowImpl CV_FINAL : public DISOpticalFlow
     void setPatchStride(int val) CV_OVERRIDE { patch_stride = val; }
     int getGradientDescentIterations() const CV_OVERRIDE { return grad_descent_iter; }
     void setGradientDescentIterations(int val) CV_OVERRIDE { grad_descent_iter = val; }
+    void getGradientDescentIterationSchedule(std::vector<int> &val) const CV_OVERRIDE { val = grad_descent_schedule; }
+    void setGradientDescentIterationSchedule(const std::vector<int> &val) CV_OVERRIDE { grad_descent_schedule = val; }
+    float getGradientDescentStepThreshold() const CV_OVERRIDE { return grad_descent_step_threshold; }
+    void setGradientDescentStepThreshold(float val) CV_OVERRIDE { grad_descent_step_threshold = val; }
+    void getGradientDescentIterationHistogram(int level, std::vector<int> &hist) const CV_OVERRIDE
+    {
+        hist.clear();
+        if (level >= 0 && level < (int)grad_descent_hist.size())
+            hist = grad_descent_hist[level];
+    }
+    float getTextureThreshold() const CV_OVERRIDE { return texture_threshold; }
+    void setTextureThreshold(float val) CV_OVERRIDE { texture_threshold = val; }
+    int getPrunedPatchCount(int level) const CV_OVERRIDE
+    {
+        return level >= 0 && level < (int)pruned_patches.size() ? pruned_patches[level] : 0;
+    }
     int getVariationalRefinementIterations() const CV_OVERRIDE { return variational_refinement_iter; }
-    void setVariationalRefinementIterations(int val) CV_OVERRIDE { variational_refinement_iter = val; }
+    void setVariationalRefinementIterations(int val) CV_OVERRIDE
+    {
+        variational_refinement_iter = val;
+        vr_params_changed = true;
+    }
     float getVariationalRefinementAlpha() const CV_OVERRIDE { return variational_refinement_alpha; }
-    void setVariationalRefinementAlpha(float val) CV_OVERRIDE { variational_refinement_alpha = val; }
+    void setVariationalRefinementAlpha(float val) CV_OVERRIDE
+    {
+        variational_refinement_alpha = val;
+        vr_params_changed = true;
+    }
     float getVariationalRefinementDelta() const CV_OVERRIDE { return variational_refinement_delta; }
-    void setVariationalRefinementDelta(float val) CV_OVERRIDE { variational_refinement_delta = val; }
+    void setVariationalRefinementDelta(float val) CV_OVERRIDE
+    {
+        variational_refinement_delta = val;
+        vr_params_changed = true;
+    }
     float getVariationalRefinementGamma() const CV_OVERRIDE { return variational_refinement_gamma; }
-    void setVariationalRefinementGamma(float val) CV_OVERRIDE { variational_refinement_gamma = val; }
+    void setVariationalRefinementGamma(float val) CV_OVERRIDE
+    {
+        variational_refinement_gamma = val;
+        vr_params_changed = true;
+    }
 
     bool getUseMeanNormalization() const CV_OVERRIDE { return use_mean_normalization; }
     void setUseMeanNormalization(bool val) CV_OVERRIDE { use_mean_normalization = val; }
     bool getUseSpatialPropagation() const CV_OVERRIDE { return use_spatial_propagation; }
     void setUseSpatialPropagation(bool val) CV_OVERRIDE { use_spatial_propagation = val; }
+    int getSpatialPropagationMode() const CV_OVERRIDE { return spatial_propagation_mode; }
+    void setSpatialPropagationMode(int val) CV_OVERRIDE { spatial_propagation_mode = val; }
+    bool getUseBatchedInverseSearch() const CV_OVERRIDE { return use_batched_inverse_search; }
+    void setUseBatchedInverseSearch(bool val) CV_OVERRIDE { use_batched_inverse_search = val; }
+    float getStaticTileThreshold() const CV_OVERRIDE { return static_tile_threshold; }
+    void setStaticTileThreshold(float val) CV_OVERRIDE { static_tile_threshold = val; }
+    float getSkippedFraction() const CV_OVERRIDE { return skipped_fraction; }
+    bool getUseTemporalWarmStart() const CV_OVERRIDE { return use_temporal_warm_start; }
+    void setUseTemporalWarmStart(bool val) CV_OVERRIDE { use_temporal_warm_start = val; }
+    double getTimeBudget() const CV_OVERRIDE { return time_budget; }
+    void setTimeBudget(double val) CV_OVERRIDE { time_budget = val; }
+    int getAppliedDegradations() const CV_OVERRIDE { return applied_degradations; }
+    bool getUseAdaptiveCoarsestScale() const CV_OVERRIDE { return use_adaptive_coarsest_scale; }
+    void setUseAdaptiveCoarsestScale(bool val) CV_OVERRIDE { use_adaptive_coarsest_scale = val; }
+    float getAdaptiveScaleMargin() const CV_OVERRIDE { return adaptive_scale_margin; }
+    void setAdaptiveScaleMargin(float val) CV_OVERRIDE { adaptive_scale_margin = val; }
 
   protected:                      //!< internal buffers
     vector<Mat_<uchar> > I0s;     //!< Gaussian pyramid for the current frame
     vector<Mat_<uchar> > I1s;     //!< Gaussian pyramid for the next frame
-    vector<Mat_<uchar> > I1s_ext; //!< I1s with borders
 
     vector<Mat_<short> > I0xs; //!< Gaussian pyramid for the x gradient of the current frame
     vector<Mat_<short> > I0ys; //!< Gaussian pyramid for the y gradient of the current frame
@@ -71,11 +131,53 @@ class DISOpticalFlowImpl CV_FINAL : public DISOpticalFlow
 
     vector<Mat_<float> > initial_Ux; //!< x component of the initial flow field, if one was passed as an input
     vector<Mat_<float> > initial_Uy; //!< y component of the initial flow field, if one was passed as an input
-
-    Mat_<Vec2f> U; //!< a buffer for the merged flow
+    Mat_<float> flow_uv[2];          //!< components of the initial flow field at the input resolution
+    bool use_initial_flow;           //!< initial_Ux and initial_Uy hold the initial flow field of the current call
+    bool warm_start_ready;           //!< initial_Ux and initial_Uy hold the warped flow of the previous frame pair
+
+    /* Region of interest: only the patches whose support (extended by a margin) overlaps the mask are processed. The
+     * mask is either passed by the user or built by the static tile detection.
+     */
+    bool use_roi_mask;
+    Mat_<int> roi_integral; //!< integral image of the nonzero cells of the mask
+    int roi_scale;          //!< a cell of roi_integral covers (1 << roi_scale) x (1 << roi_scale) input pixels
+    Mat_<uchar> patch_mask; //!< nonzero for the patches of the current level that have to be processed
+    Rect level_roi;         //!< bounding box of the supports of these patches on the current level
+    bool use_static_tiles;  //!< the region of interest comes from the static tile detection
+    float skipped_fraction; //!< fraction of the patches of the finest scale skipped in the last call
+
+    /* Histograms of the gradient descent iterations used in the last call: grad_descent_hist[level][t] is the number of
+     * patch updates on the pyramid level that ran t iterations. Levels that weren't processed have empty histograms.
+     */
+    vector<vector<int> > grad_descent_hist;
+    vector<int> pruned_patches; //!< number of low-texture patches of every level that skipped the gradient descent
+
+    /* Anytime mode: the levels are timed and the remaining ones degraded when the next level is predicted to overrun
+     * the time budget
+     */
+    int64 budget_start_tick;     //!< tick count at the start of the current call
+    int applied_degradations;    //!< DISOpticalFlow::DEGRADE_* flags applied in the last call
+    int grad_descent_shift;      //!< the gradient descent iterations are divided by 1 << grad_descent_shift
+    int flow_level;              //!< pyramid level holding the dense flow computed by the last computeLevels() call
+    double densify_ms_per_pixel; //!< cost of the last measured densification per pixel, 0 if none was measured yet
+    int64 levels_end_tick;       //!< tick count after the last level of the current call
+    double post_pass_ms;         //!< time spent after the last level in the previous call (upscaling, stream state)
+
+    /* Motion-adaptive coarsest scale: in the streaming mode the levels that are too coarse for the motion of the
+     * previous frame pair are left out of the search. The pyramids are still built up to coarsest_scale.
+     */
+    int search_coarsest_scale; //!< coarsest level searched by computeLevels(), reset by selectScales()
+    float prev_max_motion;     //!< largest flow component of the previous frame pair in input pixels, < 0 if unknown
+
+    /* Horizontal sampling tables of the flow upscaling (source column and interpolation weight for every column): */
+    Mat_<int> upscale_xofs;
+    Mat_<float> upscale_alpha;
 
     Mat_<float> Sx; //!< intermediate sparse flow representation (x component)
     Mat_<float> Sy; //!< intermediate sparse flow representation (y component)
+    Mat_<float> Sx_init; //!< sparse flow of the next coarser level, upscaled to the current level (x component)
+    Mat_<float> Sy_init; //!< sparse flow of the next coarser level, upscaled to the current level (y component)
+    bool use_sparse_init; //!< Sx and Sy already hold the initial approximation on the current level
 
     /* Structure tensor components: */
     Mat_<float> I0xx_buf; //!< sum of squares of x gradient values
@@ -94,14 +196,86 @@ class DISOpticalFlowImpl CV_FINAL : public DISOpticalFlow
     Mat_<float> I0y_buf_aux;
 
     vector<Ptr<VariationalRefinement> > variational_refinement_processors;
+    bool vr_params_changed; //!< the variational refinement processors have to be reconfigured
+
+    /* All the buffers above are carved from a single block of memory that is only reallocated when the
+     * configuration below changes, so that repeated calls on frames of the same size don't allocate anything.
+     */
+    Mat buffers_arena;
+    Size buffers_size;
+    int buffers_finest_scale, buffers_coarsest_scale, buffers_patch_size, buffers_patch_stride;
+    int buffers_roi_mode;
+    int buffers_finest_pitch; //!< row stride (in elements) of the finest scale gradients, 0 if it is the level width
+    bool buffers_use_flow, buffers_stream;
+    int buffers_scratch_stripes;
+    size_t buffers_scratch_size;
+
+    /* Scratch memory of the parallel sections, one row per stripe (indexed by the first index of the range a body is
+     * called with), so that the per-row and per-patch temporaries don't go through the heap.
+     */
+    Mat_<uchar> scratch_buf;
+
+    /* Zero-copy input: with finest_scale == 0 the finest level headers of I0s and I1s may reference the frames passed
+     * by the caller. The carved buffers they replace are kept here and restored by the next prepareBuffers() call.
+     */
+    Mat_<uchar> finest_bufs[2];
+    bool finest_external;
+
+    /* Streaming mode (calcNext) state. The gradients and structure tensors of the last frame are computed at the end
+     * of each call, so that the next call only has to build the pyramid of the new frame.
+     */
+    bool stream_ready; //!< I1s holds the pyramid of the previous frame passed to calcNext
+    vector<Mat_<short> > I1xs; //!< Gaussian pyramid for the x gradient of the last frame
+    vector<Mat_<short> > I1ys; //!< Gaussian pyramid for the y gradient of the last frame
+    /* Per-level structure tensors, components stacked vertically in the order xx, yy, xy, x, y: */
+    vector<Mat_<float> > I0_tensors; //!< structure tensors of the current frame
+    vector<Mat_<float> > I1_tensors; //!< structure tensors of the last frame
 
   private: //!< private methods and parallel sections
-    void prepareBuffers(Mat &I0, Mat &I1, Mat &flow, bool use_flow);
+    enum
+    {
+        ROI_NONE = 0,
+        ROI_MASK = 1,        //!< region of interest given by a mask at the input resolution
+        ROI_STATIC_TILES = 2 //!< region of interest given by the tiles that changed between the frames
+    };
+    bool allocateBuffers(Size img_size, bool use_flow, bool stream, int roi_mode = ROI_NONE, int finest_pitch = 0);
+    int scratchStripes(Size img_size) const;
+    size_t scratchStripeSize(Size img_size) const;
+    bool canReferenceInput(const Mat &I0, const Mat &I1) const;
+    int inputPitch(const Mat &I0, const Mat &I1) const;
+    int staticTileLevel() const;
+    void computeRoiIntegral(const Mat &mask);
+    void detectStaticTiles();
+    void computePatchMask(int level);
+    void prepareBuffers(Mat &I0, Mat &I1, Mat &flow, bool use_flow, bool reuse_I0 = false);
+    void buildFinestLevel(const Mat &src, Mat &dst);
+    void selectScales(Size img_size);
+    void computeFlow(Mat &flow, bool use_precomputed_tensors);
+    int computeLevels(bool use_precomputed_tensors, bool densify_finest);
+    void densifyLocation(float &dst_Ux, float &dst_Uy, int i, int j);
+    void upscaleSparseFlow(int src_ws, int src_hs);
+    void prepareNextFrame();
+    void prepareWarmStart();
+    int adaptiveCoarsestScale();
+    void updateMotionStatistics();
     void precomputeStructureTensor(Mat &dst_I0xx, Mat &dst_I0yy, Mat &dst_I0xy, Mat &dst_I0x, Mat &dst_I0y, Mat &I0x,
-                                   Mat &I0y);
+                                   Mat &I0y, const Rect &roi);
     int autoSelectCoarsestScale(int img_width);
     void autoSelectPatchSizeAndScales(int img_width);
+    int gradDescentIterations(int pyr_level) const;
+    void patchInverseSearch(int nstripes, int num_iter, int pyr_level);
+    template <int PSZ> void runPatchInverseSearch(int nstripes, int num_iter, int pyr_level);
+
+    /* Size (in patches) of the square tiles used by the wavefront spatial propagation schedule */
+    static const int wavefront_tile_size = 8;
 
+    /* log2 of the size (in pixels of the pyramid level used for the change detection) of the static tiles */
+    static const int static_tile_size_log2 = 3;
+
+    /* The patch size is a template parameter so that the patch processing functions are fully unrolled for the common
+     * sizes (8 and 12). PSZ == 0 is the fallback for any other patch size, which is then read from dis->patch_size.
+     */
+    template <int PSZ>
     struct PatchInverseSearch_ParBody : public ParallelLoopBody
     {
         DISOpticalFlowImpl *dis;
@@ -109,10 +283,42 @@ class DISOpticalFlowImpl CV_FINAL : public DISOpticalFlow
         int hs;
         Mat *Sx, *Sy, *Ux, *Uy, *I0, *I1, *I0x, *I0y;
         int num_iter, pyr_level;
+        int wavefront_diag, wavefront_pass; //!< tile anti-diagonal and pass in the wavefront mode, -1 for stripes
 
         PatchInverseSearch_ParBody(DISOpticalFlowImpl &_dis, int _nstripes, int _hs, Mat &dst_Sx, Mat &dst_Sy,
                                    Mat &src_Ux, Mat &src_Uy, Mat &_I0, Mat &_I1, Mat &_I0x, Mat &_I0y, int _num_iter,
-                                   int _pyr_level);
+                                   int _pyr_level, int _wavefront_diag = -1, int _wavefront_pass = 0);
+        void operator()(const Range &range) const CV_OVERRIDE;
+        void processRegion(int start_iter, int end_iter, const Range &rows, const Range &cols,
+                           const Range &prop_rows, const Range &prop_cols, int stripe) const;
+#if CV_SIMD128
+        void inverseSearchBatch(int is, int js, const uchar *lane_mask, const float *initial_Ux_ptr,
+                                const float *initial_Uy_ptr, int num_inner_iter, int *iter_hist, int &num_pruned,
+                                uchar *edge_buf, float *soa_buf) const;
+#endif
+    };
+
+    struct StructureTensorHorizontal_ParBody : public ParallelLoopBody
+    {
+        DISOpticalFlowImpl *dis;
+        int nstripes, stripe_sz;
+        Mat *I0x, *I0y;
+        Rect roi; //!< part of the level covered by the patches whose structure tensors are computed
+
+        StructureTensorHorizontal_ParBody(DISOpticalFlowImpl &_dis, int _nstripes, Mat &_I0x, Mat &_I0y,
+                                          const Rect &_roi);
+        void operator()(const Range &range) const CV_OVERRIDE;
+    };
+
+    struct StructureTensorVertical_ParBody : public ParallelLoopBody
+    {
+        DISOpticalFlowImpl *dis;
+        int nstripes, stripe_sz;
+        Mat *I0xx, *I0yy, *I0xy, *I0x, *I0y;
+        Rect roi; //!< part of the level covered by the patches whose structure tensors are computed
+
+        StructureTensorVertical_ParBody(DISOpticalFlowImpl &_dis, int _nstripes, Mat &dst_I0xx, Mat &dst_I0yy,
+                                        Mat &dst_I0xy, Mat &dst_I0x, Mat &dst_I0y, const Rect &_roi);
         void operator()(const Range &range) const CV_OVERRIDE;
     };
 
@@ -122,12 +328,70 @@ class DISOpticalFlowImpl CV_FINAL : public DISOpticalFlow
         int nstripes, stripe_sz;
         int h;
         Mat *Ux, *Uy, *Sx, *Sy, *I0, *I1;
+        int pyr_level;
 
         Densification_ParBody(DISOpticalFlowImpl &_dis, int _nstripes, int _h, Mat &dst_Ux, Mat &dst_Uy, Mat &src_Sx,
-                              Mat &src_Sy, Mat &_I0, Mat &_I1);
+                              Mat &src_Sy, Mat &_I0, Mat &_I1, int _pyr_level);
+        void operator()(const Range &range) const CV_OVERRIDE;
+    };
+
+    /* Bilinear upscaling of the planar flow components (sampled in the same way as resize() with INTER_LINEAR) fused
+     * with the multiplication of the flow vectors by mul. The output is either interleaved into a CV_32FC2 matrix (the
+     * final flow) or planar (the initial approximation of the next pyramid level).
+     */
+    struct FlowUpscale_ParBody : public ParallelLoopBody
+    {
+        DISOpticalFlowImpl *dis;
+        int nstripes, stripe_sz;
+        Mat *src_Ux, *src_Uy;
+        Mat *dst;            //!< interleaved output, NULL if the output is planar
+        Mat *dst_Ux, *dst_Uy; //!< planar output, NULL if the output is interleaved
+        float mul;
+
+        FlowUpscale_ParBody(DISOpticalFlowImpl &_dis, int _nstripes, Mat &_src_Ux, Mat &_src_Uy, Mat &_dst,
+                            float _mul);
+        FlowUpscale_ParBody(DISOpticalFlowImpl &_dis, int _nstripes, Mat &_src_Ux, Mat &_src_Uy, Mat &_dst_Ux,
+                            Mat &_dst_Uy, float _mul);
+        void init();
+        void operator()(const Range &range) const CV_OVERRIDE;
+    };
+
+    /* Grayscale conversion of a 3 or 4-channel BGR(A) frame fused with its INTER_AREA downscaling by 1 << scale_log2,
+     * so that the finest pyramid level is produced from the color frame in a single pass. The channel count is a
+     * template parameter so that the pixels are deinterleaved with the matching vector loads.
+     */
+    template <int CN>
+    struct LumaDownscale_ParBody : public ParallelLoopBody
+    {
+        DISOpticalFlowImpl *dis;
+        int nstripes, stripe_sz;
+        const Mat *src;
+        Mat *dst;
+        int scale_log2;
+
+        LumaDownscale_ParBody(DISOpticalFlowImpl &_dis, int _nstripes, const Mat &_src, Mat &_dst, int _scale_log2);
+        void operator()(const Range &range) const CV_OVERRIDE;
+    };
+
+    /* Forward warping of a flow field along itself, used to predict the flow of the next frame pair under a constant
+     * velocity assumption. Every destination location q looks for the source location p with p + U(p) = q by the
+     * fixed-point iteration u = U(q - u) and takes u as the predicted flow.
+     */
+    struct FlowWarp_ParBody : public ParallelLoopBody
+    {
+        int nstripes, stripe_sz;
+        int h, w;
+        Mat *src_Ux, *src_Uy, *dst_Ux, *dst_Uy;
+
+        FlowWarp_ParBody(int _nstripes, Mat &_src_Ux, Mat &_src_Uy, Mat &_dst_Ux, Mat &_dst_Uy);
         void operator()(const Range &range) const CV_OVERRIDE;
     };
 
+    /* Number of fixed-point iterations used to invert the flow field in FlowWarp_ParBody */
+    static const int warm_start_warp_iter = 3;
+
+    /* Mean absolute difference (in gray levels, on the coarsest level) above which a frame pair is a scene cut */
+    static const int scene_cut_threshold = 32;
 };
 
 DISOpticalFlowImpl::DISOpticalFlowImpl()
@@ -138,141 +402,604 @@ DISOpticalFlowImpl::DISOpticalFlowImpl()
     patch_size = 8;
     patch_stride = 4;
     grad_descent_iter = 16;
+    grad_descent_step_threshold = 0.0f;
+    texture_threshold = 0.0f;
     variational_refinement_iter = 5;
     variational_refinement_alpha = 20.f;
     variational_refinement_gamma = 10.f;
     variational_refinement_delta = 5.f;
 
-    border_size = 16;
     use_mean_normalization = true;
     use_spatial_propagation = true;
+    spatial_propagation_mode = DISOpticalFlow::SPATIAL_PROPAGATION_STRIPES;
+    use_batched_inverse_search = false;
+    static_tile_threshold = 0.0f;
+    use_temporal_warm_start = false;
+    time_budget = 0.0;
+    use_adaptive_coarsest_scale = false;
+    adaptive_scale_margin = 2.0f;
     coarsest_scale = 10;
 
     /* Use separate variational refinement instances for different scales to avoid repeated memory allocation: */
     int max_possible_scales = 10;
     ws = hs = w = h = 0;
+    stream_ready = false;
+    use_initial_flow = false;
+    warm_start_ready = false;
+    use_sparse_init = false;
+    use_roi_mask = false;
+    roi_scale = 0;
+    use_static_tiles = false;
+    skipped_fraction = 0.0f;
+    budget_start_tick = 0;
+    applied_degradations = 0;
+    grad_descent_shift = 0;
+    flow_level = 0;
+    densify_ms_per_pixel = 0.0;
+    levels_end_tick = 0;
+    post_pass_ms = 0.0;
+    search_coarsest_scale = 0;
+    prev_max_motion = -1.0f;
+    vr_params_changed = true;
+    buffers_finest_scale = buffers_coarsest_scale = buffers_patch_size = buffers_patch_stride = 0;
+    buffers_roi_mode = ROI_NONE;
+    buffers_finest_pitch = 0;
+    buffers_use_flow = buffers_stream = false;
+    buffers_scratch_stripes = 0;
+    buffers_scratch_size = 0;
+    finest_external = false;
     for (int i = 0; i < max_possible_scales; i++)
         variational_refinement_processors.push_back(VariationalRefinement::create());
 }
 
-void DISOpticalFlowImpl::prepareBuffers(Mat &I0, Mat &I1, Mat &flow, bool use_flow)
+/* Carves Mat headers out of a single preallocated block of memory. With a NULL base it only measures the size the
+ * block needs to have.
+ */
+struct BufferArena
+{
+    uchar *base;
+    size_t offset;
+
+    BufferArena(uchar *_base) : base(_base), offset(0) {}
+
+    template <typename T> void carve(Mat_<T> &m, int rows, int cols)
+    {
+        if (base)
+            m = Mat_<T>(rows, cols, (T *)(base + offset));
+        offset += alignSize((size_t)rows * cols * sizeof(T), CV_MALLOC_ALIGN);
+    }
+
+    template <typename T> T *carve(int n)
+    {
+        T *ptr = base ? (T *)(base + offset) : NULL;
+        offset += alignSize((size_t)n * sizeof(T), CV_MALLOC_ALIGN);
+        return ptr;
+    }
+};
+
+/* Number of scratch_buf rows: enough for the thread count, for the fixed 8 stripes of the spatial propagation and
+ * for the tiles on the longest anti-diagonal of the wavefront mode
+ */
+int DISOpticalFlowImpl::scratchStripes(Size img_size) const
+{
+    const int T = wavefront_tile_size;
+    int tiles_y = ((img_size.height >> finest_scale) / patch_stride + T - 1) / T;
+    int tiles_x = ((img_size.width >> finest_scale) / patch_stride + T - 1) / T;
+    return max(max(getNumThreads(), 8), min(tiles_y, tiles_x));
+}
+
+/* Size of a scratch_buf row. The inverse search needs the footprint copies of the border patches, the transposed I0
+ * patches of the batched search and a local iteration histogram; the flow upscaling needs two rows of the finest level
+ * and the color downscaling a row of column sums of the input frame.
+ */
+size_t DISOpticalFlowImpl::scratchStripeSize(Size img_size) const
+{
+    int max_iter = grad_descent_iter;
+    for (size_t k = 0; k < grad_descent_schedule.size(); k++)
+        max_iter = max(max_iter, grad_descent_schedule[k]);
+    BufferArena search(NULL);
+    search.carve<uchar>(4 * (patch_size + 1) * (patch_size + 1));
+    search.carve<float>(3 * 4 * patch_size * patch_size);
+    search.carve<int>(max(max_iter, 0) + 1);
+
+    BufferArena rows(NULL);
+    rows.carve<float>(2 * ((img_size.width >> finest_scale) + 1));
+
+    BufferArena color(NULL);
+    color.carve<int>((img_size.width >> finest_scale) << finest_scale);
+    return max(max(search.offset, rows.offset), color.offset);
+}
+
+/* Carves all the internal buffers for the given input size and the current parameters out of buffers_arena. Does
+ * nothing if the configuration hasn't changed since the last call. Returns true if the buffers were reallocated, which
+ * discards their contents. The initial flow buffers are kept once allocated, so that passing an initial flow only
+ * occasionally doesn't cause reallocations. A nonzero finest_pitch is the row stride of the input frame that the
+ * finest level will reference; the gradients of that level are then carved with the same stride.
+ */
+bool DISOpticalFlowImpl::allocateBuffers(Size img_size, bool use_flow, bool stream, int roi_mode, int finest_pitch)
 {
     CV_INSTRUMENT_REGION();
 
+    use_flow = use_flow || buffers_use_flow;
+    int scratch_stripes = scratchStripes(img_size);
+    size_t scratch_size = scratchStripeSize(img_size);
+    if (!buffers_arena.empty() && img_size == buffers_size && finest_scale == buffers_finest_scale &&
+        coarsest_scale == buffers_coarsest_scale && patch_size == buffers_patch_size &&
+        patch_stride == buffers_patch_stride && use_flow == buffers_use_flow && stream == buffers_stream &&
+        roi_mode == buffers_roi_mode && finest_pitch == buffers_finest_pitch &&
+        scratch_stripes == buffers_scratch_stripes && scratch_size == buffers_scratch_size)
+        return false;
+
+    /* Drop the headers pointing to the previous block before releasing it: */
+    I0s.clear();
+    I1s.clear();
+    I0xs.clear();
+    I0ys.clear();
+    Ux.clear();
+    Uy.clear();
+    initial_Ux.clear();
+    initial_Uy.clear();
+    I1xs.clear();
+    I1ys.clear();
+    I0_tensors.clear();
+    I1_tensors.clear();
+    finest_bufs[0].release();
+    finest_bufs[1].release();
+    finest_external = false;
+    buffers_arena.release();
+
     I0s.resize(coarsest_scale + 1);
     I1s.resize(coarsest_scale + 1);
-    I1s_ext.resize(coarsest_scale + 1);
     I0xs.resize(coarsest_scale + 1);
     I0ys.resize(coarsest_scale + 1);
     Ux.resize(coarsest_scale + 1);
     Uy.resize(coarsest_scale + 1);
-
-    Mat flow_uv[2];
     if (use_flow)
     {
-        split(flow, flow_uv);
         initial_Ux.resize(coarsest_scale + 1);
         initial_Uy.resize(coarsest_scale + 1);
     }
+    if (stream)
+    {
+        I1xs.resize(coarsest_scale + 1);
+        I1ys.resize(coarsest_scale + 1);
+        I0_tensors.resize(coarsest_scale + 1);
+        I1_tensors.resize(coarsest_scale + 1);
+    }
+
+    /* The first pass measures the arena, the second one carves the buffers out of it */
+    size_t arena_size = 0;
+    for (int pass = 0; pass < 2; pass++)
+    {
+        if (pass == 1)
+            buffers_arena.create(1, (int)arena_size, CV_8U);
+        BufferArena arena(pass == 1 ? buffers_arena.ptr() : NULL);
+
+        int rows = img_size.height >> finest_scale;
+        int cols = img_size.width >> finest_scale;
+        int sparse_rows = rows / patch_stride;
+        int sparse_cols = cols / patch_stride;
+
+        /* These buffers are reused in each scale so they are sized for the finest scale: */
+        arena.carve(Sx, sparse_rows, sparse_cols);
+        arena.carve(Sy, sparse_rows, sparse_cols);
+        arena.carve(Sx_init, sparse_rows, sparse_cols);
+        arena.carve(Sy_init, sparse_rows, sparse_cols);
+        arena.carve(patch_mask, sparse_rows, sparse_cols);
+        if (roi_mode == ROI_MASK)
+            arena.carve(roi_integral, img_size.height + 1, img_size.width + 1);
+        else if (roi_mode == ROI_STATIC_TILES)
+        {
+            int tile_log2 = staticTileLevel() + static_tile_size_log2;
+            int tile = 1 << tile_log2;
+            arena.carve(roi_integral, (img_size.height + tile - 1) / tile + 1, (img_size.width + tile - 1) / tile + 1);
+        }
+        if (!stream)
+        {
+            arena.carve(I0xx_buf, sparse_rows, sparse_cols);
+            arena.carve(I0yy_buf, sparse_rows, sparse_cols);
+            arena.carve(I0xy_buf, sparse_rows, sparse_cols);
+            arena.carve(I0x_buf, sparse_rows, sparse_cols);
+            arena.carve(I0y_buf, sparse_rows, sparse_cols);
+        }
+        arena.carve(I0xx_buf_aux, rows, sparse_cols);
+        arena.carve(I0yy_buf_aux, rows, sparse_cols);
+        arena.carve(I0xy_buf_aux, rows, sparse_cols);
+        arena.carve(I0x_buf_aux, rows, sparse_cols);
+        arena.carve(I0y_buf_aux, rows, sparse_cols);
+        arena.carve(upscale_xofs, 1, img_size.width);
+        arena.carve(upscale_alpha, 1, img_size.width);
+        arena.carve(scratch_buf, scratch_stripes, (int)scratch_size);
+        if (use_flow)
+        {
+            arena.carve(flow_uv[0], img_size.height, img_size.width);
+            arena.carve(flow_uv[1], img_size.height, img_size.width);
+        }
 
-    int fraction = 1;
-    int cur_rows = 0, cur_cols = 0;
+        for (int i = finest_scale; i <= coarsest_scale; i++)
+        {
+            rows = img_size.height >> i;
+            cols = img_size.width >> i;
+            arena.carve(I0s[i], rows, cols);
+            arena.carve(I1s[i], rows, cols);
+            int grad_pitch = i == finest_scale && finest_pitch > cols ? finest_pitch : cols;
+            arena.carve(I0xs[i], rows, grad_pitch);
+            arena.carve(I0ys[i], rows, grad_pitch);
+            if (pass == 1 && grad_pitch > cols)
+            {
+                I0xs[i] = I0xs[i].colRange(0, cols);
+                I0ys[i] = I0ys[i].colRange(0, cols);
+            }
+            arena.carve(Ux[i], rows, cols);
+            arena.carve(Uy[i], rows, cols);
+            if (use_flow)
+            {
+                arena.carve(initial_Ux[i], rows, cols);
+                arena.carve(initial_Uy[i], rows, cols);
+            }
+            if (stream)
+            {
+                int level_ws = 1 + (cols - patch_size) / patch_stride;
+                int level_hs = 1 + (rows - patch_size) / patch_stride;
+                arena.carve(I1xs[i], rows, cols);
+                arena.carve(I1ys[i], rows, cols);
+                arena.carve(I0_tensors[i], 5 * level_hs, level_ws);
+                arena.carve(I1_tensors[i], 5 * level_hs, level_ws);
+            }
+        }
+        arena_size = arena.offset;
+    }
 
-    for (int i = 0; i <= coarsest_scale; i++)
+    buffers_size = img_size;
+    buffers_finest_scale = finest_scale;
+    buffers_coarsest_scale = coarsest_scale;
+    buffers_patch_size = patch_size;
+    buffers_patch_stride = patch_stride;
+    buffers_use_flow = use_flow;
+    buffers_stream = stream;
+    buffers_roi_mode = roi_mode;
+    buffers_finest_pitch = finest_pitch;
+    buffers_scratch_stripes = scratch_stripes;
+    buffers_scratch_size = scratch_size;
+    vr_params_changed = true;
+    return true;
+}
+
+inline bool isSupportedChannels(int cn) { return cn == 1 || cn == 3 || cn == 4; }
+
+/* Fixed-point BGR to gray coefficients (the same as cvtColor uses) */
+enum
+{
+    LUMA_SHIFT = 14,
+    LUMA_B = 1868,
+    LUMA_G = 9617,
+    LUMA_R = 4899
+};
+
+template <int CN>
+DISOpticalFlowImpl::LumaDownscale_ParBody<CN>::LumaDownscale_ParBody(DISOpticalFlowImpl &_dis, int _nstripes,
+                                                                     const Mat &_src, Mat &_dst, int _scale_log2)
+    : dis(&_dis), nstripes(_nstripes), src(&_src), dst(&_dst), scale_log2(_scale_log2)
+{
+    stripe_sz = (int)ceil(dst->rows / (double)nstripes);
+}
+
+#if CV_SIMD128
+/* Adds the gray values of 8 pixels given as 16-bit B, G and R lanes to sum_ptr[0..7] */
+inline void accumulateLuma(const v_uint16x8 &b, const v_uint16x8 &g, const v_uint16x8 &r, int *sum_ptr)
+{
+    v_uint32x4 b_lo, b_hi, g_lo, g_hi, r_lo, r_hi;
+    v_mul_expand(b, v_setall_u16(LUMA_B), b_lo, b_hi);
+    v_mul_expand(g, v_setall_u16(LUMA_G), g_lo, g_hi);
+    v_mul_expand(r, v_setall_u16(LUMA_R), r_lo, r_hi);
+    v_uint32x4 half = v_setall_u32(1 << (LUMA_SHIFT - 1));
+    v_store(sum_ptr, v_load(sum_ptr) + v_reinterpret_as_s32((b_lo + g_lo + r_lo + half) >> LUMA_SHIFT));
+    v_store(sum_ptr + 4, v_load(sum_ptr + 4) + v_reinterpret_as_s32((b_hi + g_hi + r_hi + half) >> LUMA_SHIFT));
+}
+#endif
+
+template <int CN> void DISOpticalFlowImpl::LumaDownscale_ParBody<CN>::operator()(const Range &range) const
+{
+    CV_INSTRUMENT_REGION();
+
+    int start_i = min(range.start * stripe_sz, dst->rows);
+    int end_i = min(range.end * stripe_sz, dst->rows);
+    int f = 1 << scale_log2;
+    int dst_w = dst->cols;
+    int src_w = dst_w * f;
+
+    /* Every destination pixel is the rounded mean of the gray values of an f x f block. The gray values of the f source
+     * rows of a destination row are first summed column-wise, then every f columns are summed:
+     */
+    int *sum_ptr = (int *)dis->scratch_buf.ptr(range.start);
+    for (int i = start_i; i < end_i; i++)
     {
-        /* Avoid initializing the pyramid levels above the finest scale, as they won't be used anyway */
-        if (i == finest_scale)
-        {
-            cur_rows = I0.rows / fraction;
-            cur_cols = I0.cols / fraction;
-            I0s[i].create(cur_rows, cur_cols);
-            resize(I0, I0s[i], I0s[i].size(), 0.0, 0.0, INTER_AREA);
-            I1s[i].create(cur_rows, cur_cols);
-            resize(I1, I1s[i], I1s[i].size(), 0.0, 0.0, INTER_AREA);
-
-            /* These buffers are reused in each scale so we initialize them once on the finest scale: */
-            Sx.create(cur_rows / patch_stride, cur_cols / patch_stride);
-            Sy.create(cur_rows / patch_stride, cur_cols / patch_stride);
-            I0xx_buf.create(cur_rows / patch_stride, cur_cols / patch_stride);
-            I0yy_buf.create(cur_rows / patch_stride, cur_cols / patch_stride);
-            I0xy_buf.create(cur_rows / patch_stride, cur_cols / patch_stride);
-            I0x_buf.create(cur_rows / patch_stride, cur_cols / patch_stride);
-            I0y_buf.create(cur_rows / patch_stride, cur_cols / patch_stride);
-
-            I0xx_buf_aux.create(cur_rows, cur_cols / patch_stride);
-            I0yy_buf_aux.create(cur_rows, cur_cols / patch_stride);
-            I0xy_buf_aux.create(cur_rows, cur_cols / patch_stride);
-            I0x_buf_aux.create(cur_rows, cur_cols / patch_stride);
-            I0y_buf_aux.create(cur_rows, cur_cols / patch_stride);
-
-            U.create(cur_rows, cur_cols);
-        }
-        else if (i > finest_scale)
-        {
-            cur_rows = I0s[i - 1].rows / 2;
-            cur_cols = I0s[i - 1].cols / 2;
-            I0s[i].create(cur_rows, cur_cols);
-            resize(I0s[i - 1], I0s[i], I0s[i].size(), 0.0, 0.0, INTER_AREA);
-            I1s[i].create(cur_rows, cur_cols);
-            resize(I1s[i - 1], I1s[i], I1s[i].size(), 0.0, 0.0, INTER_AREA);
+        memset(sum_ptr, 0, src_w * sizeof(int));
+        for (int r = 0; r < f; r++)
+        {
+            const uchar *src_row = src->ptr<uchar>(i * f + r);
+            int j = 0;
+#if CV_SIMD128
+            for (; j <= src_w - 16; j += 16)
+            {
+                v_uint8x16 b, g, r8, a;
+                if (CN == 3)
+                    v_load_deinterleave(src_row + j * CN, b, g, r8);
+                else
+                    v_load_deinterleave(src_row + j * CN, b, g, r8, a);
+                v_uint16x8 b_lo, b_hi, g_lo, g_hi, r_lo, r_hi;
+                v_expand(b, b_lo, b_hi);
+                v_expand(g, g_lo, g_hi);
+                v_expand(r8, r_lo, r_hi);
+                accumulateLuma(b_lo, g_lo, r_lo, sum_ptr + j);
+                accumulateLuma(b_hi, g_hi, r_hi, sum_ptr + j + 8);
+            }
+#endif
+            for (; j < src_w; j++)
+            {
+                const uchar *p = src_row + j * CN;
+                sum_ptr[j] += (p[0] * LUMA_B + p[1] * LUMA_G + p[2] * LUMA_R + (1 << (LUMA_SHIFT - 1))) >> LUMA_SHIFT;
+            }
+        }
+        uchar *dst_row = dst->ptr<uchar>(i);
+        for (int j = 0; j < dst_w; j++)
+        {
+            const int *block_ptr = sum_ptr + j * f;
+            int acc = 0;
+            for (int k = 0; k < f; k++)
+                acc += block_ptr[k];
+            dst_row[j] = (uchar)((acc + (1 << (2 * scale_log2 - 1))) >> (2 * scale_log2));
         }
+    }
+}
+
+/* Produces the finest pyramid level from an input frame. Gray frames are downscaled with INTER_AREA; color frames are
+ * converted to gray at full resolution only when the finest scale is 0 and in the same pass as the downscaling
+ * otherwise (the rows and columns that don't fill a whole block are dropped, as the level size is rounded down).
+ */
+void DISOpticalFlowImpl::buildFinestLevel(const Mat &src, Mat &dst)
+{
+    if (src.channels() == 1)
+        resize(src, dst, dst.size(), 0.0, 0.0, INTER_AREA);
+    else if (finest_scale == 0)
+        cvtColor(src, dst, src.channels() == 3 ? COLOR_BGR2GRAY : COLOR_BGRA2GRAY);
+    else
+    {
+        int num_stripes = getNumThreads();
+        if (src.channels() == 3)
+            parallel_for_(Range(0, num_stripes), LumaDownscale_ParBody<3>(*this, num_stripes, src, dst, finest_scale));
+        else
+            parallel_for_(Range(0, num_stripes), LumaDownscale_ParBody<4>(*this, num_stripes, src, dst, finest_scale));
+    }
+}
+
+/* Gray frames can be searched in place at the finest scale 0, whatever their row stride. The streaming mode always
+ * copies them, as the frames have to outlive the call.
+ */
+bool DISOpticalFlowImpl::canReferenceInput(const Mat &I0, const Mat &I1) const
+{
+    return finest_scale == 0 && I0.channels() == 1 && I1.channels() == 1;
+}
+
+/* The finest_pitch argument of allocateBuffers() for a non-streaming call on I0 and I1 */
+int DISOpticalFlowImpl::inputPitch(const Mat &I0, const Mat &I1) const
+{
+    return canReferenceInput(I0, I1) && (int)I0.step1() != I0.cols ? (int)I0.step1() : 0;
+}
+
+/* Builds the image pyramids in the buffers carved by allocateBuffers. If reuse_I0 is set (streaming mode) I0s, I0xs
+ * and I0ys already hold the pyramids of the current frame, so I0 is ignored and only the pyramid of I1 is built.
+ * Otherwise the finest level may reference I0 and I1 directly (see canReferenceInput).
+ */
+void DISOpticalFlowImpl::prepareBuffers(Mat &I0, Mat &I1, Mat &flow, bool use_flow, bool reuse_I0)
+{
+    CV_INSTRUMENT_REGION();
+
+    if (finest_external)
+    {
+        I0s[finest_scale] = finest_bufs[0];
+        I1s[finest_scale] = finest_bufs[1];
+        finest_external = false;
+    }
+    bool reference_input = !reuse_I0 && canReferenceInput(I0, I1);
+
+    use_initial_flow = use_flow;
+    if (use_flow)
+    {
+        Mat uv[] = {flow_uv[0], flow_uv[1]};
+        split(flow, uv);
+    }
 
-        if (i >= finest_scale)
+    for (int i = finest_scale; i <= coarsest_scale; i++)
+    {
+        int fraction = 1 << i;
+        if (i == finest_scale && reference_input)
+        {
+            CV_Assert((int)I0xs[i].step1() == (int)I0.step1());
+            finest_bufs[0] = I0s[i];
+            finest_bufs[1] = I1s[i];
+            I0s[i] = I0;
+            I1s[i] = I1;
+            finest_external = true;
+        }
+        else if (i == finest_scale)
         {
-            I1s_ext[i].create(cur_rows + 2 * border_size, cur_cols + 2 * border_size);
-            copyMakeBorder(I1s[i], I1s_ext[i], border_size, border_size, border_size, border_size, BORDER_REPLICATE);
-            I0xs[i].create(cur_rows, cur_cols);
-            I0ys[i].create(cur_rows, cur_cols);
+            if (!reuse_I0)
+                buildFinestLevel(I0, I0s[i]);
+            buildFinestLevel(I1, I1s[i]);
+        }
+        else
+        {
+            if (!reuse_I0)
+                resize(I0s[i - 1], I0s[i], I0s[i].size(), 0.0, 0.0, INTER_AREA);
+            resize(I1s[i - 1], I1s[i], I1s[i].size(), 0.0, 0.0, INTER_AREA);
+        }
+
+        /* With a region of interest the gradients are computed per level by computeFlow, once the region is known */
+        if (!reuse_I0 && !use_roi_mask)
             spatialGradient(I0s[i], I0xs[i], I0ys[i]);
-            Ux[i].create(cur_rows, cur_cols);
-            Uy[i].create(cur_rows, cur_cols);
+        if (vr_params_changed)
+        {
             variational_refinement_processors[i]->setAlpha(variational_refinement_alpha);
             variational_refinement_processors[i]->setDelta(variational_refinement_delta);
             variational_refinement_processors[i]->setGamma(variational_refinement_gamma);
             variational_refinement_processors[i]->setSorIterations(5);
             variational_refinement_processors[i]->setFixedPointIterations(variational_refinement_iter);
-
-            if (use_flow)
-            {
-                resize(flow_uv[0], initial_Ux[i], Size(cur_cols, cur_rows));
-                initial_Ux[i] /= fraction;
-                resize(flow_uv[1], initial_Uy[i], Size(cur_cols, cur_rows));
-                initial_Uy[i] /= fraction;
-            }
         }
 
-        fraction *= 2;
+        if (use_flow)
+        {
+            resize(flow_uv[0], initial_Ux[i], initial_Ux[i].size());
+            initial_Ux[i] /= fraction;
+            resize(flow_uv[1], initial_Uy[i], initial_Uy[i].size());
+            initial_Uy[i] /= fraction;
+        }
     }
+    vr_params_changed = false;
 }
 
 /* This function computes the structure tensor elements (local sums of I0x^2, I0x*I0y and I0y^2).
  * A simple box filter is not used instead because we need to compute these sums on a sparse grid
- * and store them densely in the output buffers.
+ * and store them densely in the output buffers. Only the patches inside roi are computed; its top left corner has to
+ * lie on the patch grid and its size has to be a whole number of patch strides plus the patch size (as level_roi).
  */
 void DISOpticalFlowImpl::precomputeStructureTensor(Mat &dst_I0xx, Mat &dst_I0yy, Mat &dst_I0xy, Mat &dst_I0x,
-                                                   Mat &dst_I0y, Mat &I0x, Mat &I0y)
+                                                   Mat &dst_I0y, Mat &I0x, Mat &I0y, const Rect &roi)
 {
     CV_INSTRUMENT_REGION();
 
-    float *I0xx_ptr = dst_I0xx.ptr<float>();
-    float *I0yy_ptr = dst_I0yy.ptr<float>();
-    float *I0xy_ptr = dst_I0xy.ptr<float>();
-    float *I0x_ptr = dst_I0x.ptr<float>();
-    float *I0y_ptr = dst_I0y.ptr<float>();
+    int num_stripes = getNumThreads();
+
+    /* Separable box filter: the horizontal pass is split into row stripes, the vertical pass into column stripes */
+    parallel_for_(Range(0, num_stripes), StructureTensorHorizontal_ParBody(*this, num_stripes, I0x, I0y, roi));
+    parallel_for_(Range(0, num_stripes), StructureTensorVertical_ParBody(*this, num_stripes, dst_I0xx, dst_I0yy,
+                                                                         dst_I0xy, dst_I0x, dst_I0y, roi));
+}
+
+DISOpticalFlowImpl::StructureTensorHorizontal_ParBody::StructureTensorHorizontal_ParBody(DISOpticalFlowImpl &_dis,
+                                                                                         int _nstripes, Mat &_I0x,
+                                                                                         Mat &_I0y, const Rect &_roi)
+    : dis(&_dis), nstripes(_nstripes), I0x(&_I0x), I0y(&_I0y), roi(_roi)
+{
+    stripe_sz = (int)ceil(roi.height / (double)nstripes);
+}
+
+#if CV_SIMD128
+/* Stores the 4 lanes of v into 4 consecutive rows of a buffer with the given row stride */
+inline void storeLanesToRows(float *dst, int stride, const v_float32x4 &v)
+{
+    float buf[4];
+    v_store(buf, v);
+    for (int k = 0; k < 4; k++)
+        dst[k * stride] = buf[k];
+}
+
+/* Loads columns j ... j + n - 1 (1 <= n <= 4) of 4 rows, so that dst[c] holds column j + c of all the rows. Full
+ * chunks are read as contiguous row segments and transposed in registers.
+ */
+inline void loadColumns4(v_int32x4 (&dst)[4], const short *const *rows, int j, int n)
+{
+    if (n == 4)
+        v_transpose4x4(v_load_expand(rows[0] + j), v_load_expand(rows[1] + j), v_load_expand(rows[2] + j),
+                       v_load_expand(rows[3] + j), dst[0], dst[1], dst[2], dst[3]);
+    else
+        for (int c = 0; c < n; c++)
+            dst[c] = v_int32x4(rows[0][j + c], rows[1][j + c], rows[2][j + c], rows[3][j + c]);
+}
+#endif
+
+/* Horizontal pass of the structure tensor computation: running sums along every row of the gradient images, sampled
+ * with patch_stride
+ */
+void DISOpticalFlowImpl::StructureTensorHorizontal_ParBody::operator()(const Range &range) const
+{
+    CV_INSTRUMENT_REGION();
 
-    float *I0xx_aux_ptr = I0xx_buf_aux.ptr<float>();
-    float *I0yy_aux_ptr = I0yy_buf_aux.ptr<float>();
-    float *I0xy_aux_ptr = I0xy_buf_aux.ptr<float>();
-    float *I0x_aux_ptr = I0x_buf_aux.ptr<float>();
-    float *I0y_aux_ptr = I0y_buf_aux.ptr<float>();
+    int start_i = roi.y + min(range.start * stripe_sz, roi.height);
+    int end_i = roi.y + min(range.end * stripe_sz, roi.height);
+    int psz = dis->patch_size;
+    int pstr = dis->patch_stride;
+    int ws = dis->ws;
+    int start_j = roi.x;
+    int end_j = roi.x + roi.width;
+    int start_js = roi.x / pstr;
+
+    float *I0xx_aux_ptr = dis->I0xx_buf_aux.ptr<float>();
+    float *I0yy_aux_ptr = dis->I0yy_buf_aux.ptr<float>();
+    float *I0xy_aux_ptr = dis->I0xy_buf_aux.ptr<float>();
+    float *I0x_aux_ptr = dis->I0x_buf_aux.ptr<float>();
+    float *I0y_aux_ptr = dis->I0y_buf_aux.ptr<float>();
+
+    int i = start_i;
+#if CV_SIMD128
+    /* Process 4 rows at once, one row per vector lane. The products are computed in integers and converted to floats
+     * exactly like in the scalar loop, so the results are identical.
+     */
+    for (; i <= end_i - 4; i += 4)
+    {
+        const short *x_rows[4], *y_rows[4];
+        for (int k = 0; k < 4; k++)
+        {
+            x_rows[k] = I0x->ptr<short>(i + k);
+            y_rows[k] = I0y->ptr<short>(i + k);
+        }
 
-    /* Separable box filter: horizontal pass */
-    for (int i = 0; i < h; i++)
+        v_int32x4 x_v[4], y_v[4], x_prev_v[4], y_prev_v[4];
+        v_float32x4 sum_xx = v_setall_f32(0.0f), sum_yy = v_setall_f32(0.0f), sum_xy = v_setall_f32(0.0f);
+        v_float32x4 sum_x = v_setall_f32(0.0f), sum_y = v_setall_f32(0.0f);
+        for (int j = start_j; j < start_j + psz; j += 4)
+        {
+            int n = min(4, start_j + psz - j);
+            loadColumns4(x_v, x_rows, j, n);
+            loadColumns4(y_v, y_rows, j, n);
+            for (int c = 0; c < n; c++)
+            {
+                sum_xx += v_cvt_f32(x_v[c] * x_v[c]);
+                sum_yy += v_cvt_f32(y_v[c] * y_v[c]);
+                sum_xy += v_cvt_f32(x_v[c] * y_v[c]);
+                sum_x += v_cvt_f32(x_v[c]);
+                sum_y += v_cvt_f32(y_v[c]);
+            }
+        }
+        storeLanesToRows(I0xx_aux_ptr + i * ws + start_js, ws, sum_xx);
+        storeLanesToRows(I0yy_aux_ptr + i * ws + start_js, ws, sum_yy);
+        storeLanesToRows(I0xy_aux_ptr + i * ws + start_js, ws, sum_xy);
+        storeLanesToRows(I0x_aux_ptr + i * ws + start_js, ws, sum_x);
+        storeLanesToRows(I0y_aux_ptr + i * ws + start_js, ws, sum_y);
+        int js = start_js + 1;
+        for (int j = start_j + psz; j < end_j; j += 4)
+        {
+            int n = min(4, end_j - j);
+            loadColumns4(x_v, x_rows, j, n);
+            loadColumns4(y_v, y_rows, j, n);
+            loadColumns4(x_prev_v, x_rows, j - psz, n);
+            loadColumns4(y_prev_v, y_rows, j - psz, n);
+            for (int c = 0; c < n; c++)
+            {
+                sum_xx += v_cvt_f32(x_v[c] * x_v[c] - x_prev_v[c] * x_prev_v[c]);
+                sum_yy += v_cvt_f32(y_v[c] * y_v[c] - y_prev_v[c] * y_prev_v[c]);
+                sum_xy += v_cvt_f32(x_v[c] * y_v[c] - x_prev_v[c] * y_prev_v[c]);
+                sum_x += v_cvt_f32(x_v[c] - x_prev_v[c]);
+                sum_y += v_cvt_f32(y_v[c] - y_prev_v[c]);
+                if ((j + c - start_j - psz + 1) % pstr == 0)
+                {
+                    storeLanesToRows(I0xx_aux_ptr + i * ws + js, ws, sum_xx);
+                    storeLanesToRows(I0yy_aux_ptr + i * ws + js, ws, sum_yy);
+                    storeLanesToRows(I0xy_aux_ptr + i * ws + js, ws, sum_xy);
+                    storeLanesToRows(I0x_aux_ptr + i * ws + js, ws, sum_x);
+                    storeLanesToRows(I0y_aux_ptr + i * ws + js, ws, sum_y);
+                    js++;
+                }
+            }
+        }
+    }
+#endif
+    for (; i < end_i; i++)
     {
         float sum_xx = 0.0f, sum_yy = 0.0f, sum_xy = 0.0f, sum_x = 0.0f, sum_y = 0.0f;
-        short *x_row = I0x.ptr<short>(i);
-        short *y_row = I0y.ptr<short>(i);
-        for (int j = 0; j < patch_size; j++)
+        short *x_row = I0x->ptr<short>(i);
+        short *y_row = I0y->ptr<short>(i);
+        for (int j = start_j; j < start_j + psz; j++)
         {
             sum_xx += x_row[j] * x_row[j];
             sum_yy += y_row[j] * y_row[j];
@@ -280,20 +1007,20 @@ void DISOpticalFlowImpl::precomputeStructureTensor(Mat &dst_I0xx, Mat &dst_I0yy,
             sum_x += x_row[j];
             sum_y += y_row[j];
         }
-        I0xx_aux_ptr[i * ws] = sum_xx;
-        I0yy_aux_ptr[i * ws] = sum_yy;
-        I0xy_aux_ptr[i * ws] = sum_xy;
-        I0x_aux_ptr[i * ws] = sum_x;
-        I0y_aux_ptr[i * ws] = sum_y;
-        int js = 1;
-        for (int j = patch_size; j < w; j++)
-        {
-            sum_xx += (x_row[j] * x_row[j] - x_row[j - patch_size] * x_row[j - patch_size]);
-            sum_yy += (y_row[j] * y_row[j] - y_row[j - patch_size] * y_row[j - patch_size]);
-            sum_xy += (x_row[j] * y_row[j] - x_row[j - patch_size] * y_row[j - patch_size]);
-            sum_x += (x_row[j] - x_row[j - patch_size]);
-            sum_y += (y_row[j] - y_row[j - patch_size]);
-            if ((j - patch_size + 1) % patch_stride == 0)
+        I0xx_aux_ptr[i * ws + start_js] = sum_xx;
+        I0yy_aux_ptr[i * ws + start_js] = sum_yy;
+        I0xy_aux_ptr[i * ws + start_js] = sum_xy;
+        I0x_aux_ptr[i * ws + start_js] = sum_x;
+        I0y_aux_ptr[i * ws + start_js] = sum_y;
+        int js = start_js + 1;
+        for (int j = start_j + psz; j < end_j; j++)
+        {
+            sum_xx += (x_row[j] * x_row[j] - x_row[j - psz] * x_row[j - psz]);
+            sum_yy += (y_row[j] * y_row[j] - y_row[j - psz] * y_row[j - psz]);
+            sum_xy += (x_row[j] * y_row[j] - x_row[j - psz] * y_row[j - psz]);
+            sum_x += (x_row[j] - x_row[j - psz]);
+            sum_y += (y_row[j] - y_row[j - psz]);
+            if ((j - start_j - psz + 1) % pstr == 0)
             {
                 I0xx_aux_ptr[i * ws + js] = sum_xx;
                 I0yy_aux_ptr[i * ws + js] = sum_yy;
@@ -304,57 +1031,122 @@ void DISOpticalFlowImpl::precomputeStructureTensor(Mat &dst_I0xx, Mat &dst_I0yy,
             }
         }
     }
+}
 
-    AutoBuffer<float> sum_xx(ws), sum_yy(ws), sum_xy(ws), sum_x(ws), sum_y(ws);
-    for (int j = 0; j < ws; j++)
-    {
-        sum_xx[j] = 0.0f;
-        sum_yy[j] = 0.0f;
-        sum_xy[j] = 0.0f;
-        sum_x[j] = 0.0f;
-        sum_y[j] = 0.0f;
-    }
+DISOpticalFlowImpl::StructureTensorVertical_ParBody::StructureTensorVertical_ParBody(DISOpticalFlowImpl &_dis,
+                                                                                     int _nstripes, Mat &dst_I0xx,
+                                                                                     Mat &dst_I0yy, Mat &dst_I0xy,
+                                                                                     Mat &dst_I0x, Mat &dst_I0y,
+                                                                                     const Rect &_roi)
+    : dis(&_dis), nstripes(_nstripes), I0xx(&dst_I0xx), I0yy(&dst_I0yy), I0xy(&dst_I0xy), I0x(&dst_I0x),
+      I0y(&dst_I0y), roi(_roi)
+{
+    int roi_ws = roi.empty() ? 0 : 1 + (roi.width - dis->patch_size) / dis->patch_stride;
+    stripe_sz = (int)ceil(roi_ws / (double)nstripes);
+}
+
+/* Vertical pass of the structure tensor computation: running sums along every column of the horizontal pass results,
+ * sampled with patch_stride. Each column is independent, so the running sums of 4 neighbouring columns are kept in
+ * vector registers and there is no need for intermediate buffers.
+ */
+void DISOpticalFlowImpl::StructureTensorVertical_ParBody::operator()(const Range &range) const
+{
+    CV_INSTRUMENT_REGION();
 
-    /* Separable box filter: vertical pass */
-    for (int i = 0; i < patch_size; i++)
-        for (int j = 0; j < ws; j++)
+    int psz = dis->patch_size;
+    int pstr = dis->patch_stride;
+    int ws = dis->ws;
+    int roi_ws = roi.empty() ? 0 : 1 + (roi.width - psz) / pstr;
+    int start_j = roi.x / pstr + min(range.start * stripe_sz, roi_ws);
+    int end_j = roi.x / pstr + min(range.end * stripe_sz, roi_ws);
+    int start_i = roi.y;
+    int end_i = roi.y + roi.height;
+    int start_is = roi.y / pstr;
+
+    float *I0xx_ptr = I0xx->ptr<float>();
+    float *I0yy_ptr = I0yy->ptr<float>();
+    float *I0xy_ptr = I0xy->ptr<float>();
+    float *I0x_ptr = I0x->ptr<float>();
+    float *I0y_ptr = I0y->ptr<float>();
+
+    const float *I0xx_aux_ptr = dis->I0xx_buf_aux.ptr<float>();
+    const float *I0yy_aux_ptr = dis->I0yy_buf_aux.ptr<float>();
+    const float *I0xy_aux_ptr = dis->I0xy_buf_aux.ptr<float>();
+    const float *I0x_aux_ptr = dis->I0x_buf_aux.ptr<float>();
+    const float *I0y_aux_ptr = dis->I0y_buf_aux.ptr<float>();
+
+    int j = start_j;
+#if CV_SIMD128
+    for (; j <= end_j - 4; j += 4)
+    {
+        v_float32x4 sum_xx = v_setall_f32(0.0f), sum_yy = v_setall_f32(0.0f), sum_xy = v_setall_f32(0.0f);
+        v_float32x4 sum_x = v_setall_f32(0.0f), sum_y = v_setall_f32(0.0f);
+        for (int i = start_i; i < start_i + psz; i++)
         {
-            sum_xx[j] += I0xx_aux_ptr[i * ws + j];
-            sum_yy[j] += I0yy_aux_ptr[i * ws + j];
-            sum_xy[j] += I0xy_aux_ptr[i * ws + j];
-            sum_x[j] += I0x_aux_ptr[i * ws + j];
-            sum_y[j] += I0y_aux_ptr[i * ws + j];
+            sum_xx += v_load(I0xx_aux_ptr + i * ws + j);
+            sum_yy += v_load(I0yy_aux_ptr + i * ws + j);
+            sum_xy += v_load(I0xy_aux_ptr + i * ws + j);
+            sum_x += v_load(I0x_aux_ptr + i * ws + j);
+            sum_y += v_load(I0y_aux_ptr + i * ws + j);
+        }
+        v_store(I0xx_ptr + start_is * ws + j, sum_xx);
+        v_store(I0yy_ptr + start_is * ws + j, sum_yy);
+        v_store(I0xy_ptr + start_is * ws + j, sum_xy);
+        v_store(I0x_ptr + start_is * ws + j, sum_x);
+        v_store(I0y_ptr + start_is * ws + j, sum_y);
+        int is = start_is + 1;
+        for (int i = start_i + psz; i < end_i; i++)
+        {
+            sum_xx += (v_load(I0xx_aux_ptr + i * ws + j) - v_load(I0xx_aux_ptr + (i - psz) * ws + j));
+            sum_yy += (v_load(I0yy_aux_ptr + i * ws + j) - v_load(I0yy_aux_ptr + (i - psz) * ws + j));
+            sum_xy += (v_load(I0xy_aux_ptr + i * ws + j) - v_load(I0xy_aux_ptr + (i - psz) * ws + j));
+            sum_x += (v_load(I0x_aux_ptr + i * ws + j) - v_load(I0x_aux_ptr + (i - psz) * ws + j));
+            sum_y += (v_load(I0y_aux_ptr + i * ws + j) - v_load(I0y_aux_ptr + (i - psz) * ws + j));
+            if ((i - start_i - psz + 1) % pstr == 0)
+            {
+                v_store(I0xx_ptr + is * ws + j, sum_xx);
+                v_store(I0yy_ptr + is * ws + j, sum_yy);
+                v_store(I0xy_ptr + is * ws + j, sum_xy);
+                v_store(I0x_ptr + is * ws + j, sum_x);
+                v_store(I0y_ptr + is * ws + j, sum_y);
+                is++;
+            }
         }
-    for (int j = 0; j < ws; j++)
-    {
-        I0xx_ptr[j] = sum_xx[j];
-        I0yy_ptr[j] = sum_yy[j];
-        I0xy_ptr[j] = sum_xy[j];
-        I0x_ptr[j] = sum_x[j];
-        I0y_ptr[j] = sum_y[j];
     }
-    int is = 1;
-    for (int i = patch_size; i < h; i++)
+#endif
+    for (; j < end_j; j++)
     {
-        for (int j = 0; j < ws; j++)
+        float sum_xx = 0.0f, sum_yy = 0.0f, sum_xy = 0.0f, sum_x = 0.0f, sum_y = 0.0f;
+        for (int i = start_i; i < start_i + psz; i++)
         {
-            sum_xx[j] += (I0xx_aux_ptr[i * ws + j] - I0xx_aux_ptr[(i - patch_size) * ws + j]);
-            sum_yy[j] += (I0yy_aux_ptr[i * ws + j] - I0yy_aux_ptr[(i - patch_size) * ws + j]);
-            sum_xy[j] += (I0xy_aux_ptr[i * ws + j] - I0xy_aux_ptr[(i - patch_size) * ws + j]);
-            sum_x[j] += (I0x_aux_ptr[i * ws + j] - I0x_aux_ptr[(i - patch_size) * ws + j]);
-            sum_y[j] += (I0y_aux_ptr[i * ws + j] - I0y_aux_ptr[(i - patch_size) * ws + j]);
+            sum_xx += I0xx_aux_ptr[i * ws + j];
+            sum_yy += I0yy_aux_ptr[i * ws + j];
+            sum_xy += I0xy_aux_ptr[i * ws + j];
+            sum_x += I0x_aux_ptr[i * ws + j];
+            sum_y += I0y_aux_ptr[i * ws + j];
         }
-        if ((i - patch_size + 1) % patch_stride == 0)
+        I0xx_ptr[start_is * ws + j] = sum_xx;
+        I0yy_ptr[start_is * ws + j] = sum_yy;
+        I0xy_ptr[start_is * ws + j] = sum_xy;
+        I0x_ptr[start_is * ws + j] = sum_x;
+        I0y_ptr[start_is * ws + j] = sum_y;
+        int is = start_is + 1;
+        for (int i = start_i + psz; i < end_i; i++)
         {
-            for (int j = 0; j < ws; j++)
+            sum_xx += (I0xx_aux_ptr[i * ws + j] - I0xx_aux_ptr[(i - psz) * ws + j]);
+            sum_yy += (I0yy_aux_ptr[i * ws + j] - I0yy_aux_ptr[(i - psz) * ws + j]);
+            sum_xy += (I0xy_aux_ptr[i * ws + j] - I0xy_aux_ptr[(i - psz) * ws + j]);
+            sum_x += (I0x_aux_ptr[i * ws + j] - I0x_aux_ptr[(i - psz) * ws + j]);
+            sum_y += (I0y_aux_ptr[i * ws + j] - I0y_aux_ptr[(i - psz) * ws + j]);
+            if ((i - start_i - psz + 1) % pstr == 0)
             {
-                I0xx_ptr[is * ws + j] = sum_xx[j];
-                I0yy_ptr[is * ws + j] = sum_yy[j];
-                I0xy_ptr[is * ws + j] = sum_xy[j];
-                I0x_ptr[is * ws + j] = sum_x[j];
-                I0y_ptr[is * ws + j] = sum_y[j];
+                I0xx_ptr[is * ws + j] = sum_xx;
+                I0yy_ptr[is * ws + j] = sum_yy;
+                I0xy_ptr[is * ws + j] = sum_xy;
+                I0x_ptr[is * ws + j] = sum_x;
+                I0y_ptr[is * ws + j] = sum_y;
+                is++;
             }
-            is++;
         }
     }
 }
@@ -397,13 +1189,17 @@ void DISOpticalFlowImpl::autoSelectPatchSizeAndScales(int img_width)
     }
 }
 
-DISOpticalFlowImpl::PatchInverseSearch_ParBody::PatchInverseSearch_ParBody(DISOpticalFlowImpl &_dis, int _nstripes,
-                                                                           int _hs, Mat &dst_Sx, Mat &dst_Sy,
-                                                                           Mat &src_Ux, Mat &src_Uy, Mat &_I0, Mat &_I1,
-                                                                           Mat &_I0x, Mat &_I0y, int _num_iter,
-                                                                           int _pyr_level)
+template <int PSZ>
+DISOpticalFlowImpl::PatchInverseSearch_ParBody<PSZ>::PatchInverseSearch_ParBody(DISOpticalFlowImpl &_dis,
+                                                                                int _nstripes, int _hs, Mat &dst_Sx,
+                                                                                Mat &dst_Sy, Mat &src_Ux, Mat &src_Uy,
+                                                                                Mat &_I0, Mat &_I1, Mat &_I0x,
+                                                                                Mat &_I0y, int _num_iter,
+                                                                                int _pyr_level, int _wavefront_diag,
+                                                                                int _wavefront_pass)
     : dis(&_dis), nstripes(_nstripes), hs(_hs), Sx(&dst_Sx), Sy(&dst_Sy), Ux(&src_Ux), Uy(&src_Uy), I0(&_I0), I1(&_I1),
-      I0x(&_I0x), I0y(&_I0y), num_iter(_num_iter), pyr_level(_pyr_level)
+      I0x(&_I0x), I0y(&_I0y), num_iter(_num_iter), pyr_level(_pyr_level), wavefront_diag(_wavefront_diag),
+      wavefront_pass(_wavefront_pass)
 {
     stripe_sz = (int)ceil(hs / (double)nstripes);
 }
@@ -463,36 +1259,222 @@ DISOpticalFlowImpl::PatchInverseSearch_ParBody::PatchInverseSearch_ParBody(DISOp
     I1_row_shifted_4_left = I1_row_next_shifted_4_left;                                                                \
     I1_row_shifted_4_right = I1_row_next_shifted_4_right;
 
-/* This function essentially performs one iteration of gradient descent when finding the most similar patch in I1 for a
- * given one in I0. It assumes that I0_ptr and I1_ptr already point to the corresponding patches and w00, w01, w10, w11
- * are precomputed bilinear interpolation weights. It returns the SSD (sum of squared differences) between these patches
- * and computes the values (dst_dUx, dst_dUy) that are used in the flow vector update. HAL acceleration is implemented
- * only for the default patch size (8x8). Everything is processed in floats as using fixed-point approximations harms
- * the quality significantly.
+#if CV_SIMD256
+/* 256-bit variants of the macros above. A whole 8-pixel patch row fits into one v_float32x8 register, so the rows are
+ * not split into halves and every row of I1 is converted to floats only once (it is reused as the upper row of the next
+ * bilinear interpolation step). There is no runtime CPU dispatch for these kernels: they are only compiled in, and
+ * used, when the baseline of the build has 256-bit vectors (e.g. -DCPU_BASELINE=AVX2). Otherwise the 128-bit path is
+ * used, even on CPUs that support AVX2.
  */
-inline float processPatch(float &dst_dUx, float &dst_dUy, uchar *I0_ptr, uchar *I1_ptr, short *I0x_ptr, short *I0y_ptr,
-                          int I0_stride, int I1_stride, float w00, float w01, float w10, float w11, int patch_sz)
-{
-    float SSD = 0.0f;
-#if CV_SIMD128
-    if (patch_sz == 8)
-    {
-        /* Variables to accumulate the sums */
-        v_float32x4 Ux_vec = v_setall_f32(0);
-        v_float32x4 Uy_vec = v_setall_f32(0);
-        v_float32x4 SSD_vec = v_setall_f32(0);
+#define HAL_INIT_BILINEAR_8x8_PATCH_EXTRACTION_256                                                                     \
+    v_float32x8 w00v = v256_setall_f32(w00);                                                                           \
+    v_float32x8 w01v = v256_setall_f32(w01);                                                                           \
+    v_float32x8 w10v = v256_setall_f32(w10);                                                                           \
+    v_float32x8 w11v = v256_setall_f32(w11);                                                                           \
+                                                                                                                       \
+    v_float32x8 I1_row, I1_row_shifted, I1_row_next, I1_row_next_shifted, I_diff;                                      \
+                                                                                                                       \
+    /* Preload and convert the first row of I1: */                                                                     \
+    I1_row = v_cvt_f32(v_reinterpret_as_s32(v256_load_expand_q(I1_ptr)));                                             \
+    I1_row_shifted = v_cvt_f32(v_reinterpret_as_s32(v256_load_expand_q(I1_ptr + 1)));                                 \
+    I1_ptr += I1_stride;
 
-        v_int16x8 I0x_row, I0y_row;
-        v_int32x4 I0x_row_4_left, I0x_row_4_right, I0y_row_4_left, I0y_row_4_right;
+#define HAL_PROCESS_BILINEAR_8x8_PATCH_EXTRACTION_256                                                                  \
+    /* Load and convert the next row of I1: */                                                                         \
+    I1_row_next = v_cvt_f32(v_reinterpret_as_s32(v256_load_expand_q(I1_ptr)));                                        \
+    I1_row_next_shifted = v_cvt_f32(v_reinterpret_as_s32(v256_load_expand_q(I1_ptr + 1)));                            \
+                                                                                                                       \
+    /* Compute diffs between I0 and bilinearly interpolated I1: */                                                     \
+    I_diff = w00v * I1_row + w01v * I1_row_shifted + w10v * I1_row_next + w11v * I1_row_next_shifted -                 \
+             v_cvt_f32(v_reinterpret_as_s32(v256_load_expand_q(I0_ptr)));
 
-        HAL_INIT_BILINEAR_8x8_PATCH_EXTRACTION;
-        for (int row = 0; row < 8; row++)
-        {
-            HAL_PROCESS_BILINEAR_8x8_PATCH_EXTRACTION;
-            I0x_row = v_load(I0x_ptr);
-            v_expand(I0x_row, I0x_row_4_left, I0x_row_4_right);
-            I0y_row = v_load(I0y_ptr);
-            v_expand(I0y_row, I0y_row_4_left, I0y_row_4_right);
+#define HAL_BILINEAR_8x8_PATCH_EXTRACTION_NEXT_ROW_256                                                                 \
+    I0_ptr += I0_stride;                                                                                               \
+    I1_ptr += I1_stride;                                                                                               \
+                                                                                                                       \
+    I1_row = I1_row_next;                                                                                              \
+    I1_row_shifted = I1_row_next_shifted;
+#endif
+
+#if CV_SIMD128
+/* Helpers for the generic vector path that handles patch sizes without a dedicated 8x8 kernel (e.g. the 12x12 patches
+ * chosen by autoSelectPatchSizeAndScales). Patch rows are processed in chunks of 8 (with CV_SIMD256) and 4 pixels, and
+ * the remaining 1-3 pixels of a row form a masked chunk.
+ */
+inline v_float32x4 loadPatchChunk4(const uchar *ptr) { return v_cvt_f32(v_reinterpret_as_s32(v_load_expand_q(ptr))); }
+inline v_float32x4 loadPatchChunk4(const short *ptr) { return v_cvt_f32(v_load_expand(ptr)); }
+#if CV_SIMD256
+inline v_float32x8 loadPatchChunk8(const uchar *ptr) { return v_cvt_f32(v_reinterpret_as_s32(v256_load_expand_q(ptr))); }
+inline v_float32x8 loadPatchChunk8(const short *ptr) { return v_cvt_f32(v256_load_expand(ptr)); }
+#endif
+
+/* Loads the last n (1 <= n <= 3) pixels of a patch row without reading past them. Unused lanes repeat the last valid
+ * pixel and have to be masked out by the caller.
+ */
+template <typename T> inline v_float32x4 loadPatchTail(const T *ptr, int n)
+{
+    return v_float32x4((float)ptr[0], (float)ptr[min(1, n - 1)], (float)ptr[min(2, n - 1)], (float)ptr[n - 1]);
+}
+
+/* Accumulates the sum of differences and the sum of squared differences between the patch in I0 and the bilinearly
+ * interpolated patch in I1 and, if use_grad is set, the sums of differences multiplied by the I0 gradients. This is the
+ * common part of all patch processing functions for arbitrary patch sizes.
+ */
+template <bool use_grad>
+inline void processPatchGeneric(float &dst_sum_diff, float &dst_sum_diff_sq, float &dst_sum_I0x_mul,
+                                float &dst_sum_I0y_mul, const uchar *I0_ptr, const uchar *I1_ptr, const short *I0x_ptr,
+                                const short *I0y_ptr, int I0_stride, int I1_stride, float w00, float w01, float w10,
+                                float w11, int patch_sz)
+{
+    v_float32x4 w00v = v_setall_f32(w00);
+    v_float32x4 w01v = v_setall_f32(w01);
+    v_float32x4 w10v = v_setall_f32(w10);
+    v_float32x4 w11v = v_setall_f32(w11);
+
+    v_float32x4 sum_diff_vec = v_setall_f32(0);
+    v_float32x4 sum_diff_sq_vec = v_setall_f32(0);
+    v_float32x4 sum_I0x_mul_vec = v_setall_f32(0);
+    v_float32x4 sum_I0y_mul_vec = v_setall_f32(0);
+#if CV_SIMD256
+    v_float32x8 w00w = v256_setall_f32(w00);
+    v_float32x8 w01w = v256_setall_f32(w01);
+    v_float32x8 w10w = v256_setall_f32(w10);
+    v_float32x8 w11w = v256_setall_f32(w11);
+
+    v_float32x8 sum_diff_wvec = v256_setall_f32(0);
+    v_float32x8 sum_diff_sq_wvec = v256_setall_f32(0);
+    v_float32x8 sum_I0x_mul_wvec = v256_setall_f32(0);
+    v_float32x8 sum_I0y_mul_wvec = v256_setall_f32(0);
+#endif
+
+    int tail = patch_sz % 4;
+    v_float32x4 tail_mask(1.0f, tail > 1 ? 1.0f : 0.0f, tail > 2 ? 1.0f : 0.0f, 0.0f);
+
+    for (int i = 0; i < patch_sz; i++)
+    {
+        const uchar *I0_row = I0_ptr + i * I0_stride;
+        const uchar *I1_row = I1_ptr + i * I1_stride;
+        const uchar *I1_row_next = I1_row + I1_stride;
+        const short *I0x_row = use_grad ? I0x_ptr + i * I0_stride : NULL;
+        const short *I0y_row = use_grad ? I0y_ptr + i * I0_stride : NULL;
+        int j = 0;
+#if CV_SIMD256
+        for (; j <= patch_sz - 8; j += 8)
+        {
+            v_float32x8 I_diff = w00w * loadPatchChunk8(I1_row + j) + w01w * loadPatchChunk8(I1_row + j + 1) +
+                                 w10w * loadPatchChunk8(I1_row_next + j) + w11w * loadPatchChunk8(I1_row_next + j + 1) -
+                                 loadPatchChunk8(I0_row + j);
+            sum_diff_wvec += I_diff;
+            sum_diff_sq_wvec += I_diff * I_diff;
+            if (use_grad)
+            {
+                sum_I0x_mul_wvec += I_diff * loadPatchChunk8(I0x_row + j);
+                sum_I0y_mul_wvec += I_diff * loadPatchChunk8(I0y_row + j);
+            }
+        }
+#endif
+        for (; j <= patch_sz - 4; j += 4)
+        {
+            v_float32x4 I_diff = w00v * loadPatchChunk4(I1_row + j) + w01v * loadPatchChunk4(I1_row + j + 1) +
+                                 w10v * loadPatchChunk4(I1_row_next + j) + w11v * loadPatchChunk4(I1_row_next + j + 1) -
+                                 loadPatchChunk4(I0_row + j);
+            sum_diff_vec += I_diff;
+            sum_diff_sq_vec += I_diff * I_diff;
+            if (use_grad)
+            {
+                sum_I0x_mul_vec += I_diff * loadPatchChunk4(I0x_row + j);
+                sum_I0y_mul_vec += I_diff * loadPatchChunk4(I0y_row + j);
+            }
+        }
+        if (j < patch_sz)
+        {
+            v_float32x4 I_diff = (w00v * loadPatchTail(I1_row + j, tail) + w01v * loadPatchTail(I1_row + j + 1, tail) +
+                                  w10v * loadPatchTail(I1_row_next + j, tail) +
+                                  w11v * loadPatchTail(I1_row_next + j + 1, tail) - loadPatchTail(I0_row + j, tail)) *
+                                 tail_mask;
+            sum_diff_vec += I_diff;
+            sum_diff_sq_vec += I_diff * I_diff;
+            if (use_grad)
+            {
+                sum_I0x_mul_vec += I_diff * loadPatchTail(I0x_row + j, tail);
+                sum_I0y_mul_vec += I_diff * loadPatchTail(I0y_row + j, tail);
+            }
+        }
+    }
+
+    dst_sum_diff = v_reduce_sum(sum_diff_vec);
+    dst_sum_diff_sq = v_reduce_sum(sum_diff_sq_vec);
+    dst_sum_I0x_mul = v_reduce_sum(sum_I0x_mul_vec);
+    dst_sum_I0y_mul = v_reduce_sum(sum_I0y_mul_vec);
+#if CV_SIMD256
+    dst_sum_diff += v_reduce_sum(sum_diff_wvec);
+    dst_sum_diff_sq += v_reduce_sum(sum_diff_sq_wvec);
+    dst_sum_I0x_mul += v_reduce_sum(sum_I0x_mul_wvec);
+    dst_sum_I0y_mul += v_reduce_sum(sum_I0y_mul_wvec);
+#endif
+}
+#endif
+
+/* This function essentially performs one iteration of gradient descent when finding the most similar patch in I1 for a
+ * given one in I0. It assumes that I0_ptr and I1_ptr already point to the corresponding patches and w00, w01, w10, w11
+ * are precomputed bilinear interpolation weights. It returns the SSD (sum of squared differences) between these patches
+ * and computes the values (dst_dUx, dst_dUy) that are used in the flow vector update. The default patch size (8x8) has
+ * dedicated HAL kernels, with a 256-bit path (one patch row per register) when CV_SIMD256 is available and a 128-bit
+ * path otherwise. Other patch sizes go through processPatchGeneric, and the scalar code is only used on targets without
+ * vector units. Everything is processed in floats as using fixed-point approximations harms the quality significantly.
+ */
+inline float processPatch(float &dst_dUx, float &dst_dUy, uchar *I0_ptr, uchar *I1_ptr, short *I0x_ptr, short *I0y_ptr,
+                          int I0_stride, int I1_stride, float w00, float w01, float w10, float w11, int patch_sz)
+{
+    float SSD = 0.0f;
+#if CV_SIMD256
+    if (patch_sz == 8)
+    {
+        /* Variables to accumulate the sums */
+        v_float32x8 Ux_vec = v256_setall_f32(0);
+        v_float32x8 Uy_vec = v256_setall_f32(0);
+        v_float32x8 SSD_vec = v256_setall_f32(0);
+
+        HAL_INIT_BILINEAR_8x8_PATCH_EXTRACTION_256;
+        for (int row = 0; row < 8; row++)
+        {
+            HAL_PROCESS_BILINEAR_8x8_PATCH_EXTRACTION_256;
+
+            /* Update the sums: */
+            Ux_vec += I_diff * v_cvt_f32(v256_load_expand(I0x_ptr));
+            Uy_vec += I_diff * v_cvt_f32(v256_load_expand(I0y_ptr));
+            SSD_vec += I_diff * I_diff;
+
+            I0x_ptr += I0_stride;
+            I0y_ptr += I0_stride;
+            HAL_BILINEAR_8x8_PATCH_EXTRACTION_NEXT_ROW_256;
+        }
+
+        /* Final reduce operations: */
+        dst_dUx = v_reduce_sum(Ux_vec);
+        dst_dUy = v_reduce_sum(Uy_vec);
+        SSD = v_reduce_sum(SSD_vec);
+    }
+    else
+#elif CV_SIMD128
+    if (patch_sz == 8)
+    {
+        /* Variables to accumulate the sums */
+        v_float32x4 Ux_vec = v_setall_f32(0);
+        v_float32x4 Uy_vec = v_setall_f32(0);
+        v_float32x4 SSD_vec = v_setall_f32(0);
+
+        v_int16x8 I0x_row, I0y_row;
+        v_int32x4 I0x_row_4_left, I0x_row_4_right, I0y_row_4_left, I0y_row_4_right;
+
+        HAL_INIT_BILINEAR_8x8_PATCH_EXTRACTION;
+        for (int row = 0; row < 8; row++)
+        {
+            HAL_PROCESS_BILINEAR_8x8_PATCH_EXTRACTION;
+            I0x_row = v_load(I0x_ptr);
+            v_expand(I0x_row, I0x_row_4_left, I0x_row_4_right);
+            I0y_row = v_load(I0y_ptr);
+            v_expand(I0y_row, I0y_row_4_left, I0y_row_4_right);
 
             /* Update the sums: */
             Ux_vec += I_diff_left * v_cvt_f32(I0x_row_4_left) + I_diff_right * v_cvt_f32(I0x_row_4_right);
@@ -511,6 +1493,13 @@ inline float processPatch(float &dst_dUx, float &dst_dUy, uchar *I0_ptr, uchar *
     }
     else
 #endif
+#if CV_SIMD128
+    {
+        float sum_diff;
+        processPatchGeneric<true>(sum_diff, SSD, dst_dUx, dst_dUy, I0_ptr, I1_ptr, I0x_ptr, I0y_ptr, I0_stride,
+                                  I1_stride, w00, w01, w10, w11, patch_sz);
+    }
+#else
     {
         dst_dUx = 0.0f;
         dst_dUy = 0.0f;
@@ -527,6 +1516,7 @@ inline float processPatch(float &dst_dUx, float &dst_dUy, uchar *I0_ptr, uchar *
                 dst_dUy += diff * I0y_ptr[i * I0_stride + j];
             }
     }
+#endif
     return SSD;
 }
 
@@ -541,7 +1531,39 @@ inline float processPatchMeanNorm(float &dst_dUx, float &dst_dUy, uchar *I0_ptr,
     float sum_I0x_mul = 0.0, sum_I0y_mul = 0.0;
     float n = (float)patch_sz * patch_sz;
 
-#if CV_SIMD128
+#if CV_SIMD256
+    if (patch_sz == 8)
+    {
+        /* Variables to accumulate the sums */
+        v_float32x8 sum_I0x_mul_vec = v256_setall_f32(0);
+        v_float32x8 sum_I0y_mul_vec = v256_setall_f32(0);
+        v_float32x8 sum_diff_vec = v256_setall_f32(0);
+        v_float32x8 sum_diff_sq_vec = v256_setall_f32(0);
+
+        HAL_INIT_BILINEAR_8x8_PATCH_EXTRACTION_256;
+        for (int row = 0; row < 8; row++)
+        {
+            HAL_PROCESS_BILINEAR_8x8_PATCH_EXTRACTION_256;
+
+            /* Update the sums: */
+            sum_I0x_mul_vec += I_diff * v_cvt_f32(v256_load_expand(I0x_ptr));
+            sum_I0y_mul_vec += I_diff * v_cvt_f32(v256_load_expand(I0y_ptr));
+            sum_diff_sq_vec += I_diff * I_diff;
+            sum_diff_vec += I_diff;
+
+            I0x_ptr += I0_stride;
+            I0y_ptr += I0_stride;
+            HAL_BILINEAR_8x8_PATCH_EXTRACTION_NEXT_ROW_256;
+        }
+
+        /* Final reduce operations: */
+        sum_I0x_mul = v_reduce_sum(sum_I0x_mul_vec);
+        sum_I0y_mul = v_reduce_sum(sum_I0y_mul_vec);
+        sum_diff = v_reduce_sum(sum_diff_vec);
+        sum_diff_sq = v_reduce_sum(sum_diff_sq_vec);
+    }
+    else
+#elif CV_SIMD128
     if (patch_sz == 8)
     {
         /* Variables to accumulate the sums */
@@ -581,6 +1603,12 @@ inline float processPatchMeanNorm(float &dst_dUx, float &dst_dUy, uchar *I0_ptr,
     }
     else
 #endif
+#if CV_SIMD128
+    {
+        processPatchGeneric<true>(sum_diff, sum_diff_sq, sum_I0x_mul, sum_I0y_mul, I0_ptr, I1_ptr, I0x_ptr, I0y_ptr,
+                                  I0_stride, I1_stride, w00, w01, w10, w11, patch_sz);
+    }
+#else
     {
         float diff;
         for (int i = 0; i < patch_sz; i++)
@@ -597,6 +1625,7 @@ inline float processPatchMeanNorm(float &dst_dUx, float &dst_dUy, uchar *I0_ptr,
                 sum_I0y_mul += diff * I0y_ptr[i * I0_stride + j];
             }
     }
+#endif
     dst_dUx = sum_I0x_mul - sum_diff * x_grad_sum / n;
     dst_dUy = sum_I0y_mul - sum_diff * y_grad_sum / n;
     return sum_diff_sq - sum_diff * sum_diff / n;
@@ -607,7 +1636,21 @@ inline float computeSSD(uchar *I0_ptr, uchar *I1_ptr, int I0_stride, int I1_stri
                         float w11, int patch_sz)
 {
     float SSD = 0.0f;
-#if CV_SIMD128
+#if CV_SIMD256
+    if (patch_sz == 8)
+    {
+        v_float32x8 SSD_vec = v256_setall_f32(0);
+        HAL_INIT_BILINEAR_8x8_PATCH_EXTRACTION_256;
+        for (int row = 0; row < 8; row++)
+        {
+            HAL_PROCESS_BILINEAR_8x8_PATCH_EXTRACTION_256;
+            SSD_vec += I_diff * I_diff;
+            HAL_BILINEAR_8x8_PATCH_EXTRACTION_NEXT_ROW_256;
+        }
+        SSD = v_reduce_sum(SSD_vec);
+    }
+    else
+#elif CV_SIMD128
     if (patch_sz == 8)
     {
         v_float32x4 SSD_vec = v_setall_f32(0);
@@ -622,6 +1665,13 @@ inline float computeSSD(uchar *I0_ptr, uchar *I1_ptr, int I0_stride, int I1_stri
     }
     else
 #endif
+#if CV_SIMD128
+    {
+        float sum_diff, sum_I0x_mul, sum_I0y_mul;
+        processPatchGeneric<false>(sum_diff, SSD, sum_I0x_mul, sum_I0y_mul, I0_ptr, I1_ptr, NULL, NULL, I0_stride,
+                                   I1_stride, w00, w01, w10, w11, patch_sz);
+    }
+#else
     {
         float diff;
         for (int i = 0; i < patch_sz; i++)
@@ -633,6 +1683,7 @@ inline float computeSSD(uchar *I0_ptr, uchar *I1_ptr, int I0_stride, int I1_stri
                 SSD += diff * diff;
             }
     }
+#endif
     return SSD;
 }
 
@@ -642,7 +1693,24 @@ inline float computeSSDMeanNorm(uchar *I0_ptr, uchar *I1_ptr, int I0_stride, int
 {
     float sum_diff = 0.0f, sum_diff_sq = 0.0f;
     float n = (float)patch_sz * patch_sz;
-#if CV_SIMD128
+#if CV_SIMD256
+    if (patch_sz == 8)
+    {
+        v_float32x8 sum_diff_vec = v256_setall_f32(0);
+        v_float32x8 sum_diff_sq_vec = v256_setall_f32(0);
+        HAL_INIT_BILINEAR_8x8_PATCH_EXTRACTION_256;
+        for (int row = 0; row < 8; row++)
+        {
+            HAL_PROCESS_BILINEAR_8x8_PATCH_EXTRACTION_256;
+            sum_diff_sq_vec += I_diff * I_diff;
+            sum_diff_vec += I_diff;
+            HAL_BILINEAR_8x8_PATCH_EXTRACTION_NEXT_ROW_256;
+        }
+        sum_diff = v_reduce_sum(sum_diff_vec);
+        sum_diff_sq = v_reduce_sum(sum_diff_sq_vec);
+    }
+    else
+#elif CV_SIMD128
     if (patch_sz == 8)
     {
         v_float32x4 sum_diff_vec = v_setall_f32(0);
@@ -659,8 +1727,15 @@ inline float computeSSDMeanNorm(uchar *I0_ptr, uchar *I1_ptr, int I0_stride, int
         sum_diff_sq = v_reduce_sum(sum_diff_sq_vec);
     }
     else
-    {
 #endif
+#if CV_SIMD128
+    {
+        float sum_I0x_mul, sum_I0y_mul;
+        processPatchGeneric<false>(sum_diff, sum_diff_sq, sum_I0x_mul, sum_I0y_mul, I0_ptr, I1_ptr, NULL, NULL,
+                                   I0_stride, I1_stride, w00, w01, w10, w11, patch_sz);
+    }
+#else
+    {
         float diff;
         for (int i = 0; i < patch_sz; i++)
             for (int j = 0; j < patch_sz; j++)
@@ -672,21 +1747,275 @@ inline float computeSSDMeanNorm(uchar *I0_ptr, uchar *I1_ptr, int I0_stride, int
                 sum_diff += diff;
                 sum_diff_sq += diff * diff;
             }
-#if CV_SIMD128
     }
 #endif
     return sum_diff_sq - sum_diff * sum_diff / n;
 }
 
+/* Smaller eigenvalue of the structure tensor [xx xy; xy yy] of a patch. It is low when the patch has no texture in
+ * some direction, which makes the gradient descent steps meaningless.
+ */
+inline float minEigenvalue(float xx, float yy, float xy)
+{
+    float half_diff = 0.5f * (xx - yy);
+    return 0.5f * (xx + yy) - sqrt(half_diff * half_diff + xy * xy);
+}
+
+/* I1 is read without any padding. The bilinear footprint of a patch, (patch_sz + 1) x (patch_sz + 1) pixels with the
+ * top-left corner at (i, j), is read in place (with the row stride of I1) when it lies inside the image; otherwise it
+ * is copied with replicated borders into a small buffer with the row stride patch_sz + 1.
+ */
+inline bool isFootprintInside(int i, int j, int h, int w, int patch_sz)
+{
+    return i >= 0 && j >= 0 && i + patch_sz < h && j + patch_sz < w;
+}
+
+inline void copyFootprint(uchar *dst, const uchar *I1_ptr, int I1_stride, int h, int w, int i, int j, int patch_sz)
+{
+    int fsz = patch_sz + 1;
+    for (int r = 0; r < fsz; r++)
+    {
+        const uchar *I1_row = I1_ptr + min(max(i + r, 0), h - 1) * I1_stride;
+        for (int c = 0; c < fsz; c++)
+            dst[r * fsz + c] = I1_row[min(max(j + c, 0), w - 1)];
+    }
+}
+
+inline uchar *fetchFootprint(int &dst_stride, uchar *I1_ptr, int I1_stride, int h, int w, int i, int j, int patch_sz,
+                             uchar *buf)
+{
+    if (isFootprintInside(i, j, h, w, patch_sz))
+    {
+        dst_stride = I1_stride;
+        return I1_ptr + i * I1_stride + j;
+    }
+    copyFootprint(buf, I1_ptr, I1_stride, h, w, i, j, patch_sz);
+    dst_stride = patch_sz + 1;
+    return buf;
+}
+
+/* Computes the SSD (mean-normalized if requested) between one patch in I0 and num_candidates (at most 4) candidate
+ * patches in I1 in a single pass, so that the I0 patch is loaded and converted only once. I1_ptrs and weights hold the
+ * bilinear interpolation setup of each candidate (4 weights w00, w01, w10, w11 per candidate).
+ */
+inline void computeSSDMulti(float *dst_SSD, uchar *I0_ptr, uchar *const *I1_ptrs, const float *weights,
+                            int num_candidates, int I0_stride, int I1_stride, int patch_sz, bool use_mean_normalization)
+{
+    float n = (float)patch_sz * patch_sz;
+#if CV_SIMD128
+    v_float32x4 w00v[4], w01v[4], w10v[4], w11v[4];
+    v_float32x4 sum_diff_vec[4], sum_diff_sq_vec[4];
+#if CV_SIMD256
+    v_float32x8 w00w[4], w01w[4], w10w[4], w11w[4];
+    v_float32x8 sum_diff_wvec[4], sum_diff_sq_wvec[4];
+#endif
+    for (int c = 0; c < num_candidates; c++)
+    {
+        w00v[c] = v_setall_f32(weights[4 * c]);
+        w01v[c] = v_setall_f32(weights[4 * c + 1]);
+        w10v[c] = v_setall_f32(weights[4 * c + 2]);
+        w11v[c] = v_setall_f32(weights[4 * c + 3]);
+        sum_diff_vec[c] = sum_diff_sq_vec[c] = v_setall_f32(0);
+#if CV_SIMD256
+        w00w[c] = v256_setall_f32(weights[4 * c]);
+        w01w[c] = v256_setall_f32(weights[4 * c + 1]);
+        w10w[c] = v256_setall_f32(weights[4 * c + 2]);
+        w11w[c] = v256_setall_f32(weights[4 * c + 3]);
+        sum_diff_wvec[c] = sum_diff_sq_wvec[c] = v256_setall_f32(0);
+#endif
+    }
+
+    int tail = patch_sz % 4;
+    v_float32x4 tail_mask(1.0f, tail > 1 ? 1.0f : 0.0f, tail > 2 ? 1.0f : 0.0f, 0.0f);
+
+    for (int i = 0; i < patch_sz; i++)
+    {
+        const uchar *I0_row = I0_ptr + i * I0_stride;
+        int j = 0;
+#if CV_SIMD256
+        for (; j <= patch_sz - 8; j += 8)
+        {
+            v_float32x8 I0_chunk = loadPatchChunk8(I0_row + j);
+            for (int c = 0; c < num_candidates; c++)
+            {
+                const uchar *I1_row = I1_ptrs[c] + i * I1_stride + j;
+                v_float32x8 I_diff = w00w[c] * loadPatchChunk8(I1_row) + w01w[c] * loadPatchChunk8(I1_row + 1) +
+                                     w10w[c] * loadPatchChunk8(I1_row + I1_stride) +
+                                     w11w[c] * loadPatchChunk8(I1_row + I1_stride + 1) - I0_chunk;
+                sum_diff_wvec[c] += I_diff;
+                sum_diff_sq_wvec[c] += I_diff * I_diff;
+            }
+        }
+#endif
+        for (; j <= patch_sz - 4; j += 4)
+        {
+            v_float32x4 I0_chunk = loadPatchChunk4(I0_row + j);
+            for (int c = 0; c < num_candidates; c++)
+            {
+                const uchar *I1_row = I1_ptrs[c] + i * I1_stride + j;
+                v_float32x4 I_diff = w00v[c] * loadPatchChunk4(I1_row) + w01v[c] * loadPatchChunk4(I1_row + 1) +
+                                     w10v[c] * loadPatchChunk4(I1_row + I1_stride) +
+                                     w11v[c] * loadPatchChunk4(I1_row + I1_stride + 1) - I0_chunk;
+                sum_diff_vec[c] += I_diff;
+                sum_diff_sq_vec[c] += I_diff * I_diff;
+            }
+        }
+        if (j < patch_sz)
+        {
+            v_float32x4 I0_chunk = loadPatchTail(I0_row + j, tail);
+            for (int c = 0; c < num_candidates; c++)
+            {
+                const uchar *I1_row = I1_ptrs[c] + i * I1_stride + j;
+                v_float32x4 I_diff =
+                  (w00v[c] * loadPatchTail(I1_row, tail) + w01v[c] * loadPatchTail(I1_row + 1, tail) +
+                   w10v[c] * loadPatchTail(I1_row + I1_stride, tail) +
+                   w11v[c] * loadPatchTail(I1_row + I1_stride + 1, tail) - I0_chunk) *
+                  tail_mask;
+                sum_diff_vec[c] += I_diff;
+                sum_diff_sq_vec[c] += I_diff * I_diff;
+            }
+        }
+    }
+
+    for (int c = 0; c < num_candidates; c++)
+    {
+        float sum_diff = v_reduce_sum(sum_diff_vec[c]);
+        float sum_diff_sq = v_reduce_sum(sum_diff_sq_vec[c]);
+#if CV_SIMD256
+        sum_diff += v_reduce_sum(sum_diff_wvec[c]);
+        sum_diff_sq += v_reduce_sum(sum_diff_sq_wvec[c]);
+#endif
+        dst_SSD[c] = use_mean_normalization ? sum_diff_sq - sum_diff * sum_diff / n : sum_diff_sq;
+    }
+#else
+    for (int c = 0; c < num_candidates; c++)
+    {
+        const float *wc = weights + 4 * c;
+        if (use_mean_normalization)
+            dst_SSD[c] = computeSSDMeanNorm(I0_ptr, I1_ptrs[c], I0_stride, I1_stride, wc[0], wc[1], wc[2], wc[3],
+                                            patch_sz);
+        else
+            dst_SSD[c] = computeSSD(I0_ptr, I1_ptrs[c], I0_stride, I1_stride, wc[0], wc[1], wc[2], wc[3], patch_sz);
+    }
+    CV_UNUSED(n);
+#endif
+}
+
+#if CV_SIMD128
+/* Loads pixels offset ... offset + n - 1 (1 <= n <= 4) from a row of each of the 4 patches of a batch and transposes
+ * them, so that dst[c] holds pixel offset + c of all the lanes. Only the first n vectors of dst are valid.
+ */
+template <typename T>
+inline void loadTransposedBatch4(v_float32x4 (&dst)[4], const T *const *rows, int offset, int n)
+{
+    v_float32x4 a0, a1, a2, a3;
+    if (n == 4)
+    {
+        a0 = loadPatchChunk4(rows[0] + offset);
+        a1 = loadPatchChunk4(rows[1] + offset);
+        a2 = loadPatchChunk4(rows[2] + offset);
+        a3 = loadPatchChunk4(rows[3] + offset);
+    }
+    else
+    {
+        a0 = loadPatchTail(rows[0] + offset, n);
+        a1 = loadPatchTail(rows[1] + offset, n);
+        a2 = loadPatchTail(rows[2] + offset, n);
+        a3 = loadPatchTail(rows[3] + offset, n);
+    }
+    v_transpose4x4(a0, a1, a2, a3, dst[0], dst[1], dst[2], dst[3]);
+}
+
+/* Batched counterpart of processPatchGeneric that handles 4 patches at once, one patch per vector lane, so the sums do
+ * not need any horizontal reductions. The I0 patches and their gradients are passed pre-transposed (4 interleaved
+ * lanes per pixel). The I1 rows are read in contiguous chunks of 4 pixels per lane and transposed in registers.
+ */
+template <bool use_grad>
+inline void processPatchBatch4(v_float32x4 &dst_sum_diff, v_float32x4 &dst_sum_diff_sq, v_float32x4 &dst_sum_I0x_mul,
+                               v_float32x4 &dst_sum_I0y_mul, const float *I0_soa, const float *I0x_soa,
+                               const float *I0y_soa, const uchar *const *I1_ptrs, int I1_stride,
+                               const v_float32x4 &w00, const v_float32x4 &w01, const v_float32x4 &w10,
+                               const v_float32x4 &w11, int patch_sz)
+{
+    v_float32x4 sum_diff = v_setall_f32(0);
+    v_float32x4 sum_diff_sq = v_setall_f32(0);
+    v_float32x4 sum_I0x_mul = v_setall_f32(0);
+    v_float32x4 sum_I0y_mul = v_setall_f32(0);
+
+    const uchar *rows[4], *rows_next[4];
+    v_float32x4 I1_left[4], I1_right[4], I1_left_next[4], I1_right_next[4];
+    for (int i = 0; i < patch_sz; i++)
+    {
+        for (int k = 0; k < 4; k++)
+        {
+            rows[k] = I1_ptrs[k] + i * I1_stride;
+            rows_next[k] = rows[k] + I1_stride;
+        }
+        for (int j = 0; j < patch_sz; j += 4)
+        {
+            int n = min(4, patch_sz - j);
+            loadTransposedBatch4(I1_left, rows, j, n);
+            loadTransposedBatch4(I1_right, rows, j + 1, n);
+            loadTransposedBatch4(I1_left_next, rows_next, j, n);
+            loadTransposedBatch4(I1_right_next, rows_next, j + 1, n);
+            for (int c = 0; c < n; c++)
+            {
+                int idx = 4 * (i * patch_sz + j + c);
+                v_float32x4 I_diff = w00 * I1_left[c] + w01 * I1_right[c] + w10 * I1_left_next[c] +
+                                     w11 * I1_right_next[c] - v_load(I0_soa + idx);
+
+                sum_diff += I_diff;
+                sum_diff_sq += I_diff * I_diff;
+                if (use_grad)
+                {
+                    sum_I0x_mul += I_diff * v_load(I0x_soa + idx);
+                    sum_I0y_mul += I_diff * v_load(I0y_soa + idx);
+                }
+            }
+        }
+    }
+
+    dst_sum_diff = sum_diff;
+    dst_sum_diff_sq = sum_diff_sq;
+    dst_sum_I0x_mul = sum_I0x_mul;
+    dst_sum_I0y_mul = sum_I0y_mul;
+}
+#endif
+
 #undef HAL_INIT_BILINEAR_8x8_PATCH_EXTRACTION
 #undef HAL_PROCESS_BILINEAR_8x8_PATCH_EXTRACTION
 #undef HAL_BILINEAR_8x8_PATCH_EXTRACTION_NEXT_ROW
+#if CV_SIMD256
+#undef HAL_INIT_BILINEAR_8x8_PATCH_EXTRACTION_256
+#undef HAL_PROCESS_BILINEAR_8x8_PATCH_EXTRACTION_256
+#undef HAL_BILINEAR_8x8_PATCH_EXTRACTION_NEXT_ROW_256
+#endif
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-void DISOpticalFlowImpl::PatchInverseSearch_ParBody::operator()(const Range &range) const
+template <int PSZ>
+void DISOpticalFlowImpl::PatchInverseSearch_ParBody<PSZ>::operator()(const Range &range) const
 {
     CV_INSTRUMENT_REGION();
 
+    if (wavefront_diag >= 0)
+    {
+        /* Wavefront mode: each index of the range is a tile on the anti-diagonal wavefront_diag. All the tiles that
+         * this pass depends on (the previous ones in the scan order) lie on the previous anti-diagonals, so spatial
+         * candidates are taken across tile borders and the result is the same as for a single full-frame scan.
+         */
+        const int T = wavefront_tile_size;
+        int tiles_x = (dis->ws + T - 1) / T;
+        int first_ti = max(0, wavefront_diag - tiles_x + 1);
+        for (int n = range.start; n < range.end; n++)
+        {
+            int ti = first_ti + n;
+            int tj = wavefront_diag - ti;
+            processRegion(wavefront_pass, wavefront_pass + 1, Range(ti * T, min((ti + 1) * T, hs)),
+                          Range(tj * T, min((tj + 1) * T, dis->ws)), Range(0, hs), Range(0, dis->ws), n);
+        }
+        return;
+    }
+
     // force separate processing of stripes if we are using spatial propagation:
     if (dis->use_spatial_propagation && range.end > range.start + 1)
     {
@@ -694,10 +2023,36 @@ void DISOpticalFlowImpl::PatchInverseSearch_ParBody::operator()(const Range &ran
             (*this)(Range(n, n + 1));
         return;
     }
-    int psz = dis->patch_size;
-    int psz2 = psz / 2;
-    int w_ext = dis->w + 2 * dis->border_size; //!< width of I1_ext
-    int bsz = dis->border_size;
+    Range rows(min(range.start * stripe_sz, hs), min(range.end * stripe_sz, hs));
+    processRegion(0, num_iter, rows, Range(0, dis->ws), rows, Range(0, dis->ws), range.start);
+}
+
+/* Runs the passes [start_iter, end_iter) of the inverse search over the patches in rows x cols (even passes go forward,
+ * odd passes backward). Spatial candidates are only taken from neighbours inside prop_rows x prop_cols. The temporaries
+ * live in row stripe of dis->scratch_buf.
+ */
+template <int PSZ>
+void DISOpticalFlowImpl::PatchInverseSearch_ParBody<PSZ>::processRegion(int start_iter, int end_iter,
+                                                                      const Range &rows, const Range &cols,
+                                                                      const Range &prop_rows,
+                                                                      const Range &prop_cols, int stripe) const
+{
+    const int psz = PSZ > 0 ? PSZ : dis->patch_size;
+    const int psz2 = psz / 2;
+    const int w = dis->w;   //!< width of I0 (row stride of I0, I0x, I0y and the dense flow)
+    const int ws = dis->ws; //!< row stride of the sparse buffers
+    const int h = dis->h;
+    const int pstr = dis->patch_stride;
+    const int fsz = psz + 1; //!< size of the bilinear footprint of a patch in I1
+
+    /* Copies of the footprints that cross the I1 border (one per candidate or batch lane) and the transposed I0
+     * patches of the batched search:
+     */
+    BufferArena scratch(dis->scratch_buf.ptr(stripe));
+    uchar *edge_buf = scratch.carve<uchar>(4 * fsz * fsz);
+#if CV_SIMD128
+    float *soa_buf = scratch.carve<float>(3 * 4 * psz * psz);
+#endif
 
     /* Input dense flow */
     float *Ux_ptr = Ux->ptr<float>();
@@ -707,10 +2062,21 @@ void DISOpticalFlowImpl::PatchInverseSearch_ParBody::operator()(const Range &ran
     float *Sx_ptr = Sx->ptr<float>();
     float *Sy_ptr = Sy->ptr<float>();
 
+    /* The images may reference the caller's frames, so they are addressed with their own row strides. The gradients
+     * are laid out with the row stride of I0, as the patch functions use a single stride for both.
+     */
     uchar *I0_ptr = I0->ptr<uchar>();
     uchar *I1_ptr = I1->ptr<uchar>();
     short *I0x_ptr = I0x->ptr<short>();
     short *I0y_ptr = I0y->ptr<short>();
+    const int I0_step = (int)I0->step1();
+    const int I1_step = (int)I1->step1();
+    CV_DbgAssert((int)I0x->step1() == I0_step && (int)I0y->step1() == I0_step);
+
+    /* Patches outside the region of interest only keep their initial approximation. Static tiles take the initial flow
+     * instead when it is available, since they are expected to keep their previous motion.
+     */
+    const uchar *mask_ptr = dis->use_roi_mask ? dis->patch_mask.ptr<uchar>() : NULL;
 
     /* Precomputed structure tensor */
     float *xx_ptr = dis->I0xx_buf.ptr<float>();
@@ -722,25 +2088,26 @@ void DISOpticalFlowImpl::PatchInverseSearch_ParBody::operator()(const Range &ran
 
     bool use_temporal_candidates = false;
     float *initial_Ux_ptr = NULL, *initial_Uy_ptr = NULL;
-    if (!dis->initial_Ux.empty())
+    if (dis->use_initial_flow)
     {
         initial_Ux_ptr = dis->initial_Ux[pyr_level].ptr<float>();
         initial_Uy_ptr = dis->initial_Uy[pyr_level].ptr<float>();
         use_temporal_candidates = true;
     }
+    bool keep_initial_flow = mask_ptr && dis->use_static_tiles && initial_Ux_ptr;
 
     int i, j, dir;
     int start_is, end_is, start_js, end_js;
     int start_i, start_j;
-    float i_lower_limit = bsz - psz + 1.0f;
-    float i_upper_limit = bsz + dis->h - 1.0f;
-    float j_lower_limit = bsz - psz + 1.0f;
-    float j_upper_limit = bsz + dis->w - 1.0f;
+    float i_lower_limit = 1.0f - psz;
+    float i_upper_limit = h - 1.0f;
+    float j_lower_limit = 1.0f - psz;
+    float j_upper_limit = w - 1.0f;
     float dUx, dUy, i_I1, j_I1, w00, w01, w10, w11, dx, dy;
 
 #define INIT_BILINEAR_WEIGHTS(Ux, Uy) \
-    i_I1 = min(max(i + Uy + bsz, i_lower_limit), i_upper_limit); \
-    j_I1 = min(max(j + Ux + bsz, j_lower_limit), j_upper_limit); \
+    i_I1 = min(max(i + Uy, i_lower_limit), i_upper_limit); \
+    j_I1 = min(max(j + Ux, j_lower_limit), j_upper_limit); \
     { \
         float di = i_I1 - floor(i_I1); \
         float dj = j_I1 - floor(j_I1); \
@@ -750,163 +2117,563 @@ void DISOpticalFlowImpl::PatchInverseSearch_ParBody::operator()(const Range &ran
         w00 = (1 - di) * (1 - dj); \
     }
 
-#define COMPUTE_SSD(dst, Ux, Uy)                                                                                       \
-    INIT_BILINEAR_WEIGHTS(Ux, Uy);                                                                                     \
-    if (dis->use_mean_normalization)                                                                                   \
-        dst = computeSSDMeanNorm(I0_ptr + i * dis->w + j, I1_ptr + (int)i_I1 * w_ext + (int)j_I1, dis->w, w_ext, w00,  \
-                                 w01, w10, w11, psz);                                                                  \
-    else                                                                                                               \
-        dst = computeSSD(I0_ptr + i * dis->w + j, I1_ptr + (int)i_I1 * w_ext + (int)j_I1, dis->w, w_ext, w00, w01,     \
-                         w10, w11, psz);
+    int num_inner_iter = (int)floor(dis->gradDescentIterations(pyr_level) / (float)num_iter);
+    float step_thr = dis->grad_descent_step_threshold;
+    /* Patches whose structure tensor is too weak keep their best candidate without any gradient descent */
+    float texture_thr = dis->texture_threshold * psz * psz;
+    int num_pruned = 0;
 
-    int num_inner_iter = (int)floor(dis->grad_descent_iter / (float)num_iter);
-    for (int iter = 0; iter < num_iter; iter++)
+    /* Iteration counts are gathered locally and merged into the histogram of the level once per call */
+    int *iter_hist = scratch.carve<int>(num_inner_iter + 1);
+    memset(iter_hist, 0, (num_inner_iter + 1) * sizeof(int));
+
+    for (int iter = start_iter; iter < end_iter; iter++)
     {
         if (iter % 2 == 0)
         {
             dir = 1;
-            start_is = min(range.start * stripe_sz, hs);
-            end_is = min(range.end * stripe_sz, hs);
-            start_js = 0;
-            end_js = dis->ws;
-            start_i = start_is * dis->patch_stride;
-            start_j = 0;
+            start_is = rows.start;
+            end_is = rows.end;
+            start_js = cols.start;
+            end_js = cols.end;
         }
         else
         {
             dir = -1;
-            start_is = min(range.end * stripe_sz, hs) - 1;
-            end_is = min(range.start * stripe_sz, hs) - 1;
-            start_js = dis->ws - 1;
-            end_js = -1;
-            start_i = start_is * dis->patch_stride;
-            start_j = (dis->ws - 1) * dis->patch_stride;
+            start_is = rows.end - 1;
+            end_is = rows.start - 1;
+            start_js = cols.end - 1;
+            end_js = cols.start - 1;
         }
+        start_i = start_is * pstr;
+        start_j = start_js * pstr;
 
         i = start_i;
         for (int is = start_is; dir * is < dir * end_is; is += dir)
         {
             j = start_j;
-            for (int js = start_js; dir * js < dir * end_js; js += dir)
+            int row_start_js = start_js;
+#if CV_SIMD128
+            if (!dis->use_spatial_propagation && dis->use_batched_inverse_search)
             {
-                if (iter == 0)
+                /* Without spatial propagation the patches of a row are independent, so they can be processed in
+                 * batches of 4 (one patch per vector lane). The remaining patches of the row go through the regular
+                 * path. This is opt-in, as the tuned per-patch kernels are faster for the 8x8 patches.
+                 */
+                for (; row_start_js + 4 <= end_js; row_start_js += 4)
                 {
-                    /* Using result form the previous pyramid level as the very first approximation: */
-                    Sx_ptr[is * dis->ws + js] = Ux_ptr[(i + psz2) * dis->w + j + psz2];
-                    Sy_ptr[is * dis->ws + js] = Uy_ptr[(i + psz2) * dis->w + j + psz2];
+                    if (mask_ptr)
+                    {
+                        const uchar *m = mask_ptr + is * ws + row_start_js;
+                        if (!(m[0] | m[1] | m[2] | m[3]))
+                        {
+                            /* None of the 4 patches is needed: only set their initial approximation */
+                            for (int k = 0; k < 4; k++)
+                            {
+                                int c = (i + psz2) * w + (row_start_js + k) * pstr + psz2;
+                                if (keep_initial_flow)
+                                {
+                                    Sx_ptr[is * ws + row_start_js + k] = initial_Ux_ptr[c];
+                                    Sy_ptr[is * ws + row_start_js + k] = initial_Uy_ptr[c];
+                                }
+                                else if (!dis->use_sparse_init)
+                                {
+                                    Sx_ptr[is * ws + row_start_js + k] = Ux_ptr[c];
+                                    Sy_ptr[is * ws + row_start_js + k] = Uy_ptr[c];
+                                }
+                            }
+                            continue;
+                        }
+                    }
+                    inverseSearchBatch(is, row_start_js, mask_ptr ? mask_ptr + is * ws + row_start_js : NULL,
+                                       initial_Ux_ptr, initial_Uy_ptr, num_inner_iter, iter_hist, num_pruned,
+                                       edge_buf, soa_buf);
                 }
-
-                float min_SSD = INF, cur_SSD;
-                if (use_temporal_candidates || dis->use_spatial_propagation)
+                j = row_start_js * pstr;
+            }
+#endif
+            for (int js = row_start_js; dir * js < dir * end_js; js += dir)
+            {
+                if (iter == 0 && !dis->use_sparse_init)
                 {
-                    COMPUTE_SSD(min_SSD, Sx_ptr[is * dis->ws + js], Sy_ptr[is * dis->ws + js]);
+                    /* Using result form the previous pyramid level as the very first approximation: */
+                    Sx_ptr[is * ws + js] = Ux_ptr[(i + psz2) * w + j + psz2];
+                    Sy_ptr[is * ws + js] = Uy_ptr[(i + psz2) * w + j + psz2];
                 }
-
-                if (use_temporal_candidates)
+                if (mask_ptr && !mask_ptr[is * ws + js])
                 {
-                    /* Try temporal candidates (vectors from the initial flow field that was passed to the function) */
-                    COMPUTE_SSD(cur_SSD, initial_Ux_ptr[(i + psz2) * dis->w + j + psz2],
-                                initial_Uy_ptr[(i + psz2) * dis->w + j + psz2]);
-                    if (cur_SSD < min_SSD)
+                    if (iter == 0 && keep_initial_flow)
                     {
-                        min_SSD = cur_SSD;
-                        Sx_ptr[is * dis->ws + js] = initial_Ux_ptr[(i + psz2) * dis->w + j + psz2];
-                        Sy_ptr[is * dis->ws + js] = initial_Uy_ptr[(i + psz2) * dis->w + j + psz2];
+                        Sx_ptr[is * ws + js] = initial_Ux_ptr[(i + psz2) * w + j + psz2];
+                        Sy_ptr[is * ws + js] = initial_Uy_ptr[(i + psz2) * w + j + psz2];
                     }
+                    j += dir * pstr;
+                    continue;
                 }
 
-                if (dis->use_spatial_propagation)
+                /* Collect the candidates for the starting point of the gradient descent: the current approximation,
+                 * the temporal candidate (vector from the initial flow field that was passed to the function) and the
+                 * spatial candidates (neighbours that were already processed in this pass).
+                 */
+                float cand_Ux[4], cand_Uy[4];
+                int num_candidates = 0;
+                cand_Ux[num_candidates] = Sx_ptr[is * ws + js];
+                cand_Uy[num_candidates++] = Sy_ptr[is * ws + js];
+                if (use_temporal_candidates)
                 {
-                    /* Try spatial candidates: */
-                    if (dir * js > dir * start_js)
+                    cand_Ux[num_candidates] = initial_Ux_ptr[(i + psz2) * w + j + psz2];
+                    cand_Uy[num_candidates++] = initial_Uy_ptr[(i + psz2) * w + j + psz2];
+                }
+                if (dis->use_spatial_propagation)
+                {
+                    if (js - dir >= prop_cols.start && js - dir < prop_cols.end)
                     {
-                        COMPUTE_SSD(cur_SSD, Sx_ptr[is * dis->ws + js - dir], Sy_ptr[is * dis->ws + js - dir]);
-                        if (cur_SSD < min_SSD)
-                        {
-                            min_SSD = cur_SSD;
-                            Sx_ptr[is * dis->ws + js] = Sx_ptr[is * dis->ws + js - dir];
-                            Sy_ptr[is * dis->ws + js] = Sy_ptr[is * dis->ws + js - dir];
-                        }
+                        cand_Ux[num_candidates] = Sx_ptr[is * ws + js - dir];
+                        cand_Uy[num_candidates++] = Sy_ptr[is * ws + js - dir];
                     }
-                    /* Flow vectors won't actually propagate across different stripes, which is the reason for keeping
-                     * the number of stripes constant. It works well enough in practice and doesn't introduce any
-                     * visible seams.
+                    /* In the stripes mode flow vectors won't actually propagate across different stripes, which is
+                     * the reason for keeping the number of stripes constant. It works well enough in practice and
+                     * doesn't introduce any visible seams.
                      */
-                    if (dir * is > dir * start_is)
+                    if (is - dir >= prop_rows.start && is - dir < prop_rows.end)
                     {
-                        COMPUTE_SSD(cur_SSD, Sx_ptr[(is - dir) * dis->ws + js], Sy_ptr[(is - dir) * dis->ws + js]);
-                        if (cur_SSD < min_SSD)
-                        {
-                            min_SSD = cur_SSD;
-                            Sx_ptr[is * dis->ws + js] = Sx_ptr[(is - dir) * dis->ws + js];
-                            Sy_ptr[is * dis->ws + js] = Sy_ptr[(is - dir) * dis->ws + js];
-                        }
+                        cand_Ux[num_candidates] = Sx_ptr[(is - dir) * ws + js];
+                        cand_Uy[num_candidates++] = Sy_ptr[(is - dir) * ws + js];
                     }
                 }
 
+                /* Score all the candidates in a single pass over the I0 patch and keep the first one with the lowest
+                 * SSD. The bilinear setup of the winner is reused by the first gradient descent iteration.
+                 */
+                uchar *cand_I1_ptrs[4];
+                float cand_weights[4 * 4], cand_i_I1[4], cand_j_I1[4];
+                bool cand_inside = true;
+                for (int c = 0; c < num_candidates; c++)
+                {
+                    INIT_BILINEAR_WEIGHTS(cand_Ux[c], cand_Uy[c]);
+                    cand_weights[4 * c] = w00;
+                    cand_weights[4 * c + 1] = w01;
+                    cand_weights[4 * c + 2] = w10;
+                    cand_weights[4 * c + 3] = w11;
+                    cand_i_I1[c] = i_I1;
+                    cand_j_I1[c] = j_I1;
+                    cand_inside = cand_inside && isFootprintInside(cvFloor(i_I1), cvFloor(j_I1), h, w, psz);
+                }
+                /* The candidates share one I1 stride, so if any of them crosses the border all of them are copied */
+                int I1_stride = cand_inside ? I1_step : fsz;
+                for (int c = 0; c < num_candidates; c++)
+                {
+                    int i0 = cvFloor(cand_i_I1[c]), j0 = cvFloor(cand_j_I1[c]);
+                    if (cand_inside)
+                        cand_I1_ptrs[c] = I1_ptr + i0 * I1_step + j0;
+                    else
+                    {
+                        cand_I1_ptrs[c] = edge_buf + c * fsz * fsz;
+                        copyFootprint(cand_I1_ptrs[c], I1_ptr, I1_step, h, w, i0, j0, psz);
+                    }
+                }
+                int best = 0;
+                if (num_candidates > 1)
+                {
+                    float cand_SSD[4];
+                    computeSSDMulti(cand_SSD, I0_ptr + i * I0_step + j, cand_I1_ptrs, cand_weights, num_candidates,
+                                    I0_step, I1_stride, psz, dis->use_mean_normalization);
+                    for (int c = 1; c < num_candidates; c++)
+                        if (cand_SSD[c] < cand_SSD[best])
+                            best = c;
+                }
+                uchar *I1_patch_ptr = cand_I1_ptrs[best];
+                w00 = cand_weights[4 * best];
+                w01 = cand_weights[4 * best + 1];
+                w10 = cand_weights[4 * best + 2];
+                w11 = cand_weights[4 * best + 3];
+
                 /* Use the best candidate as a starting point for the gradient descent: */
-                float cur_Ux = Sx_ptr[is * dis->ws + js];
-                float cur_Uy = Sy_ptr[is * dis->ws + js];
+                Sx_ptr[is * ws + js] = cand_Ux[best];
+                Sy_ptr[is * ws + js] = cand_Uy[best];
+                float cur_Ux = cand_Ux[best];
+                float cur_Uy = cand_Uy[best];
+
+                if (texture_thr > 0 &&
+                    minEigenvalue(xx_ptr[is * ws + js], yy_ptr[is * ws + js], xy_ptr[is * ws + js]) < texture_thr)
+                {
+                    num_pruned += iter == 0;
+                    iter_hist[0]++;
+                    j += dir * pstr;
+                    continue;
+                }
 
                 /* Computing the inverse of the structure tensor: */
-                float detH = xx_ptr[is * dis->ws + js] * yy_ptr[is * dis->ws + js] -
-                             xy_ptr[is * dis->ws + js] * xy_ptr[is * dis->ws + js];
+                float detH = xx_ptr[is * ws + js] * yy_ptr[is * ws + js] -
+                             xy_ptr[is * ws + js] * xy_ptr[is * ws + js];
                 if (abs(detH) < EPS)
                     detH = EPS;
-                float invH11 = yy_ptr[is * dis->ws + js] / detH;
-                float invH12 = -xy_ptr[is * dis->ws + js] / detH;
-                float invH22 = xx_ptr[is * dis->ws + js] / detH;
+                float invH11 = yy_ptr[is * ws + js] / detH;
+                float invH12 = -xy_ptr[is * ws + js] / detH;
+                float invH22 = xx_ptr[is * ws + js] / detH;
                 float prev_SSD = INF, SSD;
-                float x_grad_sum = x_ptr[is * dis->ws + js];
-                float y_grad_sum = y_ptr[is * dis->ws + js];
+                float x_grad_sum = x_ptr[is * ws + js];
+                float y_grad_sum = y_ptr[is * ws + js];
 
-                for (int t = 0; t < num_inner_iter; t++)
+                int t = 0;
+                while (t < num_inner_iter)
                 {
-                    INIT_BILINEAR_WEIGHTS(cur_Ux, cur_Uy);
+                    if (t > 0)
+                    {
+                        INIT_BILINEAR_WEIGHTS(cur_Ux, cur_Uy);
+                        I1_patch_ptr = fetchFootprint(I1_stride, I1_ptr, I1_step, h, w, cvFloor(i_I1), cvFloor(j_I1),
+                                                      psz, edge_buf);
+                    }
                     if (dis->use_mean_normalization)
                         SSD = processPatchMeanNorm(dUx, dUy,
-                                I0_ptr  + i * dis->w + j, I1_ptr + (int)i_I1 * w_ext + (int)j_I1,
-                                I0x_ptr + i * dis->w + j, I0y_ptr + i * dis->w + j,
-                                dis->w, w_ext, w00, w01, w10, w11, psz,
+                                I0_ptr  + i * I0_step + j, I1_patch_ptr,
+                                I0x_ptr + i * I0_step + j, I0y_ptr + i * I0_step + j,
+                                I0_step, I1_stride, w00, w01, w10, w11, psz,
                                 x_grad_sum, y_grad_sum);
                     else
                         SSD = processPatch(dUx, dUy,
-                                I0_ptr  + i * dis->w + j, I1_ptr + (int)i_I1 * w_ext + (int)j_I1,
-                                I0x_ptr + i * dis->w + j, I0y_ptr + i * dis->w + j,
-                                dis->w, w_ext, w00, w01, w10, w11, psz);
+                                I0_ptr  + i * I0_step + j, I1_patch_ptr,
+                                I0x_ptr + i * I0_step + j, I0y_ptr + i * I0_step + j,
+                                I0_step, I1_stride, w00, w01, w10, w11, psz);
 
                     dx = invH11 * dUx + invH12 * dUy;
                     dy = invH12 * dUx + invH22 * dUy;
                     cur_Ux -= dx;
                     cur_Uy -= dy;
+                    t++;
 
-                    /* Break when patch distance stops decreasing */
-                    if (SSD >= prev_SSD)
+                    /* Break when patch distance stops decreasing or the step becomes negligible */
+                    if (SSD >= prev_SSD || (abs(dx) < step_thr && abs(dy) < step_thr))
                         break;
                     prev_SSD = SSD;
                 }
+                iter_hist[t]++;
 
                 /* If gradient descent converged to a flow vector that is very far from the initial approximation
                  * (more than patch size) then we don't use it. Noticeably improves the robustness.
                  */
-                if (norm(Vec2f(cur_Ux - Sx_ptr[is * dis->ws + js], cur_Uy - Sy_ptr[is * dis->ws + js])) <= psz)
+                if (norm(Vec2f(cur_Ux - Sx_ptr[is * ws + js], cur_Uy - Sy_ptr[is * ws + js])) <= psz)
                 {
-                    Sx_ptr[is * dis->ws + js] = cur_Ux;
-                    Sy_ptr[is * dis->ws + js] = cur_Uy;
+                    Sx_ptr[is * ws + js] = cur_Ux;
+                    Sy_ptr[is * ws + js] = cur_Uy;
                 }
-                j += dir * dis->patch_stride;
+                j += dir * pstr;
             }
-            i += dir * dis->patch_stride;
+            i += dir * pstr;
         }
     }
 #undef INIT_BILINEAR_WEIGHTS
-#undef COMPUTE_SSD
+
+    int *level_hist = &dis->grad_descent_hist[pyr_level][0];
+    for (int t = 0; t <= num_inner_iter; t++)
+        if (iter_hist[t])
+            CV_XADD(level_hist + t, iter_hist[t]);
+    if (num_pruned)
+        CV_XADD(&dis->pruned_patches[pyr_level], num_pruned);
+}
+
+#if CV_SIMD128
+/* Inverse search for the 4 patches (is, js) ... (is, js + 3) at once, one patch per vector lane. This is only used
+ * without spatial propagation, where the patches don't depend on each other. The gradient descent iterations of all the
+ * lanes run in lock-step, and a lane is frozen (but still computed) as soon as its patch distance stops decreasing.
+ * The lanes whose lane_mask byte is zero are frozen from the start and keep their initial approximation (the initial
+ * flow for the skipped patches of static tiles).
+ */
+template <int PSZ>
+void DISOpticalFlowImpl::PatchInverseSearch_ParBody<PSZ>::inverseSearchBatch(int is, int js, const uchar *lane_mask,
+                                                                           const float *initial_Ux_ptr,
+                                                                           const float *initial_Uy_ptr,
+                                                                           int num_inner_iter, int *iter_hist,
+                                                                           int &num_pruned, uchar *edge_buf,
+                                                                           float *soa_buf) const
+{
+    const int psz = PSZ > 0 ? PSZ : dis->patch_size;
+    const int psz2 = psz / 2;
+    const int w = dis->w;
+    const int ws = dis->ws;
+    const int h = dis->h;
+    const int pstr = dis->patch_stride;
+    const int fsz = psz + 1;
+    const int n = psz * psz;
+
+    float *Sx_ptr = Sx->ptr<float>() + is * ws + js;
+    float *Sy_ptr = Sy->ptr<float>() + is * ws + js;
+    const float *Ux_ptr = Ux->ptr<float>();
+    const float *Uy_ptr = Uy->ptr<float>();
+    const uchar *I0_ptr = I0->ptr<uchar>();
+    const uchar *I1_ptr = I1->ptr<uchar>();
+    const short *I0x_ptr = I0x->ptr<short>();
+    const short *I0y_ptr = I0y->ptr<short>();
+    const int I0_step = (int)I0->step1();
+    const int I1_step = (int)I1->step1();
+
+    /* Transpose the I0 patches and their gradients into lane-interleaved buffers. They don't change between the
+     * iterations, so only I1 has to be transposed in the inner loop.
+     */
+    float *I0_soa = soa_buf;
+    float *I0x_soa = I0_soa + 4 * n;
+    float *I0y_soa = I0x_soa + 4 * n;
+    int i = is * pstr;
+    const bool keep_initial_flow = lane_mask && dis->use_static_tiles && initial_Ux_ptr;
+    const uchar *I0_rows[4];
+    const short *I0x_rows[4], *I0y_rows[4];
+    v_float32x4 chunk[4];
+    for (int k = 0; k < 4; k++)
+    {
+        int j = (js + k) * pstr;
+        I0_rows[k] = I0_ptr + i * I0_step + j;
+        I0x_rows[k] = I0x_ptr + i * I0_step + j;
+        I0y_rows[k] = I0y_ptr + i * I0_step + j;
+
+        /* Using result from the previous pyramid level as the very first approximation: */
+        if (!dis->use_sparse_init)
+        {
+            Sx_ptr[k] = Ux_ptr[(i + psz2) * w + j + psz2];
+            Sy_ptr[k] = Uy_ptr[(i + psz2) * w + j + psz2];
+        }
+        /* Skipped patches of static tiles carry the initial flow over, like in the regular path: */
+        if (keep_initial_flow && !lane_mask[k])
+        {
+            Sx_ptr[k] = initial_Ux_ptr[(i + psz2) * w + j + psz2];
+            Sy_ptr[k] = initial_Uy_ptr[(i + psz2) * w + j + psz2];
+        }
+    }
+    for (int r = 0; r < psz; r++)
+        for (int c = 0; c < psz; c += 4)
+        {
+            int cnt = min(4, psz - c);
+            int idx = 4 * (r * psz + c);
+            loadTransposedBatch4(chunk, I0_rows, r * I0_step + c, cnt);
+            for (int l = 0; l < cnt; l++)
+                v_store(I0_soa + idx + 4 * l, chunk[l]);
+            loadTransposedBatch4(chunk, I0x_rows, r * I0_step + c, cnt);
+            for (int l = 0; l < cnt; l++)
+                v_store(I0x_soa + idx + 4 * l, chunk[l]);
+            loadTransposedBatch4(chunk, I0y_rows, r * I0_step + c, cnt);
+            for (int l = 0; l < cnt; l++)
+                v_store(I0y_soa + idx + 4 * l, chunk[l]);
+        }
+
+    v_float32x4 one = v_setall_f32(1.0f);
+    v_float32x4 searched = one == one;
+    if (lane_mask)
+        searched = v_reinterpret_as_f32(v_int32x4(lane_mask[0], lane_mask[1], lane_mask[2], lane_mask[3]) !=
+                                        v_setall_s32(0));
+    v_float32x4 nv = v_setall_f32((float)n);
+    v_float32x4 iv = v_setall_f32((float)i);
+    v_float32x4 jv((float)(js * pstr), (float)((js + 1) * pstr), (float)((js + 2) * pstr), (float)((js + 3) * pstr));
+    v_float32x4 i_lower_limit = v_setall_f32(1.0f - psz);
+    v_float32x4 i_upper_limit = v_setall_f32(h - 1.0f);
+    v_float32x4 j_lower_limit = v_setall_f32(1.0f - psz);
+    v_float32x4 j_upper_limit = v_setall_f32(w - 1.0f);
+
+    v_float32x4 w00, w01, w10, w11;
+    v_float32x4 sum_diff, sum_diff_sq, sum_I0x_mul, sum_I0y_mul;
+    const uchar *I1_ptrs[4];
+    int I1_stride;
+    int i_I1_buf[4], j_I1_buf[4];
+
+#define INIT_BILINEAR_WEIGHTS_BATCH(Ux, Uy)                                                                            \
+    {                                                                                                                  \
+        v_float32x4 i_I1 = v_min(v_max(iv + Uy, i_lower_limit), i_upper_limit);                                        \
+        v_float32x4 j_I1 = v_min(v_max(jv + Ux, j_lower_limit), j_upper_limit);                                        \
+        v_int32x4 i_I1_int = v_floor(i_I1);                                                                            \
+        v_int32x4 j_I1_int = v_floor(j_I1);                                                                            \
+        v_float32x4 di = i_I1 - v_cvt_f32(i_I1_int);                                                                   \
+        v_float32x4 dj = j_I1 - v_cvt_f32(j_I1_int);                                                                   \
+        w11 = di * dj;                                                                                                 \
+        w10 = di * (one - dj);                                                                                         \
+        w01 = (one - di) * dj;                                                                                         \
+        w00 = (one - di) * (one - dj);                                                                                 \
+        v_store(i_I1_buf, i_I1_int);                                                                                   \
+        v_store(j_I1_buf, j_I1_int);                                                                                   \
+        bool inside = true;                                                                                            \
+        for (int k = 0; k < 4; k++)                                                                                    \
+            inside = inside && isFootprintInside(i_I1_buf[k], j_I1_buf[k], h, w, psz);                                 \
+        I1_stride = inside ? I1_step : fsz;                                                                            \
+        for (int k = 0; k < 4; k++)                                                                                    \
+        {                                                                                                              \
+            if (inside)                                                                                                \
+                I1_ptrs[k] = I1_ptr + i_I1_buf[k] * I1_step + j_I1_buf[k];                                             \
+            else                                                                                                       \
+            {                                                                                                          \
+                copyFootprint(edge_buf + k * fsz * fsz, I1_ptr, I1_step, h, w, i_I1_buf[k], j_I1_buf[k], psz);         \
+                I1_ptrs[k] = edge_buf + k * fsz * fsz;                                                                 \
+            }                                                                                                          \
+        }                                                                                                              \
+    }
+
+#define COMPUTE_SSD_BATCH(dst, Ux, Uy)                                                                                 \
+    INIT_BILINEAR_WEIGHTS_BATCH(Ux, Uy);                                                                               \
+    processPatchBatch4<false>(sum_diff, sum_diff_sq, sum_I0x_mul, sum_I0y_mul, I0_soa, NULL, NULL, I1_ptrs,           \
+                              I1_stride, w00, w01, w10, w11, psz);                                                     \
+    dst = dis->use_mean_normalization ? sum_diff_sq - sum_diff * sum_diff / nv : sum_diff_sq;
+
+    v_float32x4 cur_Ux = v_load(Sx_ptr);
+    v_float32x4 cur_Uy = v_load(Sy_ptr);
+    if (initial_Ux_ptr)
+    {
+        /* Try temporal candidates (vectors from the initial flow field that was passed to the function) */
+        int c = (i + psz2) * w + js * pstr + psz2;
+        v_float32x4 tmp_Ux(initial_Ux_ptr[c], initial_Ux_ptr[c + pstr], initial_Ux_ptr[c + 2 * pstr],
+                           initial_Ux_ptr[c + 3 * pstr]);
+        v_float32x4 tmp_Uy(initial_Uy_ptr[c], initial_Uy_ptr[c + pstr], initial_Uy_ptr[c + 2 * pstr],
+                           initial_Uy_ptr[c + 3 * pstr]);
+        v_float32x4 min_SSD, cur_SSD;
+        COMPUTE_SSD_BATCH(min_SSD, cur_Ux, cur_Uy);
+        COMPUTE_SSD_BATCH(cur_SSD, tmp_Ux, tmp_Uy);
+        v_float32x4 better = (cur_SSD < min_SSD) & searched;
+        cur_Ux = v_select(better, tmp_Ux, cur_Ux);
+        cur_Uy = v_select(better, tmp_Uy, cur_Uy);
+        v_store(Sx_ptr, cur_Ux);
+        v_store(Sy_ptr, cur_Uy);
+    }
+    v_float32x4 start_Ux = cur_Ux;
+    v_float32x4 start_Uy = cur_Uy;
+
+    /* Computing the inverse of the structure tensor: */
+    v_float32x4 xx = v_load(dis->I0xx_buf.ptr<float>() + is * ws + js);
+    v_float32x4 yy = v_load(dis->I0yy_buf.ptr<float>() + is * ws + js);
+    v_float32x4 xy = v_load(dis->I0xy_buf.ptr<float>() + is * ws + js);
+    v_float32x4 eps = v_setall_f32(EPS);
+    v_float32x4 detH = xx * yy - xy * xy;
+    detH = v_select(v_abs(detH) < eps, eps, detH);
+    v_float32x4 invH11 = yy / detH;
+    v_float32x4 invH12 = (v_setall_f32(0) - xy) / detH;
+    v_float32x4 invH22 = xx / detH;
+    v_float32x4 x_grad_sum = v_load(dis->I0x_buf.ptr<float>() + is * ws + js);
+    v_float32x4 y_grad_sum = v_load(dis->I0y_buf.ptr<float>() + is * ws + js);
+
+    v_float32x4 prev_SSD = v_setall_f32(INF), SSD, dUx, dUy, dx, dy;
+    v_float32x4 step_thr = v_setall_f32(dis->grad_descent_step_threshold);
+    v_float32x4 active = searched;
+    v_int32x4 num_used = v_setall_s32(0);
+    if (dis->texture_threshold > 0)
+    {
+        /* Low-texture lanes keep their best candidate and never take a step */
+        v_float32x4 half = v_setall_f32(0.5f);
+        v_float32x4 half_diff = half * (xx - yy);
+        v_float32x4 min_eig = half * (xx + yy) - v_sqrt(half_diff * half_diff + xy * xy);
+        v_float32x4 pruned = (min_eig < v_setall_f32(dis->texture_threshold * n)) & searched;
+        active = active & ~pruned;
+        num_pruned -= v_reduce_sum(v_reinterpret_as_s32(pruned)); //!< the mask lanes are -1 (true) or 0 (false)
+    }
+    for (int t = 0; t < num_inner_iter && v_check_any(active); t++)
+    {
+        INIT_BILINEAR_WEIGHTS_BATCH(cur_Ux, cur_Uy);
+        processPatchBatch4<true>(sum_diff, sum_diff_sq, sum_I0x_mul, sum_I0y_mul, I0_soa, I0x_soa, I0y_soa, I1_ptrs,
+                                 I1_stride, w00, w01, w10, w11, psz);
+        if (dis->use_mean_normalization)
+        {
+            dUx = sum_I0x_mul - sum_diff * x_grad_sum / nv;
+            dUy = sum_I0y_mul - sum_diff * y_grad_sum / nv;
+            SSD = sum_diff_sq - sum_diff * sum_diff / nv;
+        }
+        else
+        {
+            dUx = sum_I0x_mul;
+            dUy = sum_I0y_mul;
+            SSD = sum_diff_sq;
+        }
+
+        dx = invH11 * dUx + invH12 * dUy;
+        dy = invH12 * dUx + invH22 * dUy;
+        cur_Ux = v_select(active, cur_Ux - dx, cur_Ux);
+        cur_Uy = v_select(active, cur_Uy - dy, cur_Uy);
+        num_used += v_reinterpret_as_s32(active) & v_setall_s32(1);
+
+        /* Freeze the lanes where patch distance stops decreasing or the step becomes negligible */
+        active = active & (SSD < prev_SSD) & ((v_abs(dx) >= step_thr) | (v_abs(dy) >= step_thr));
+        if (!v_check_any(active))
+            break;
+        prev_SSD = SSD;
+    }
+#undef INIT_BILINEAR_WEIGHTS_BATCH
+#undef COMPUTE_SSD_BATCH
+
+    int num_used_buf[4];
+    v_store(num_used_buf, num_used);
+    for (int k = 0; k < 4; k++)
+        if (!lane_mask || lane_mask[k])
+            iter_hist[num_used_buf[k]]++;
+
+    /* Same robustness check as in the regular path: reject the vectors that moved further than the patch size */
+    v_float32x4 dist_x = cur_Ux - start_Ux;
+    v_float32x4 dist_y = cur_Uy - start_Uy;
+    v_float32x4 accept = dist_x * dist_x + dist_y * dist_y <= v_setall_f32((float)(psz * psz));
+    v_store(Sx_ptr, v_select(accept, cur_Ux, start_Ux));
+    v_store(Sy_ptr, v_select(accept, cur_Uy, start_Uy));
+}
+#endif
+
+/* Runs the inverse search on pyramid level pyr_level. With spatial propagation in the wavefront mode the sparse grid
+ * is split into square tiles and each pass sweeps the tile anti-diagonals in order; the tiles on one anti-diagonal are
+ * independent and processed in parallel. Otherwise the grid is split into nstripes horizontal stripes.
+ */
+template <int PSZ>
+void DISOpticalFlowImpl::runPatchInverseSearch(int nstripes, int num_iter, int pyr_level)
+{
+    int i = pyr_level;
+    if (use_spatial_propagation && spatial_propagation_mode == DISOpticalFlow::SPATIAL_PROPAGATION_WAVEFRONT)
+    {
+        const int T = wavefront_tile_size;
+        int tiles_y = (hs + T - 1) / T;
+        int tiles_x = (ws + T - 1) / T;
+        int num_diags = tiles_y + tiles_x - 1;
+        for (int pass = 0; pass < num_iter; pass++)
+            for (int n = 0; n < num_diags; n++)
+            {
+                /* Backward passes depend on the tiles below and to the right, so they sweep the diagonals backwards */
+                int d = pass % 2 == 0 ? n : num_diags - 1 - n;
+                int num_tiles = min(d, tiles_y - 1) - max(0, d - tiles_x + 1) + 1;
+                parallel_for_(Range(0, num_tiles),
+                              PatchInverseSearch_ParBody<PSZ>(*this, num_tiles, hs, Sx, Sy, Ux[i], Uy[i], I0s[i],
+                                                              I1s[i], I0xs[i], I0ys[i], num_iter, i, d, pass));
+            }
+    }
+    else
+    {
+        parallel_for_(Range(0, nstripes), PatchInverseSearch_ParBody<PSZ>(*this, nstripes, hs, Sx, Sy, Ux[i], Uy[i],
+                                                                           I0s[i], I1s[i], I0xs[i], I0ys[i],
+                                                                           num_iter, i));
+    }
+}
+
+/* Total number of gradient descent iterations (over all the passes) of the patches of pyramid level pyr_level */
+int DISOpticalFlowImpl::gradDescentIterations(int pyr_level) const
+{
+    int k = pyr_level - finest_scale;
+    int num_iter = grad_descent_iter;
+    if (k >= 0 && k < (int)grad_descent_schedule.size())
+        num_iter = max(grad_descent_schedule[k], 0);
+    return num_iter >> grad_descent_shift;
+}
+
+/* Runs the inverse search on pyramid level pyr_level with the PatchInverseSearch_ParBody instantiation that matches
+ * the current patch size
+ */
+void DISOpticalFlowImpl::patchInverseSearch(int nstripes, int num_iter, int pyr_level)
+{
+    grad_descent_hist[pyr_level].assign(gradDescentIterations(pyr_level) / num_iter + 1, 0);
+    switch (patch_size)
+    {
+    case 8:
+        runPatchInverseSearch<8>(nstripes, num_iter, pyr_level);
+        break;
+    case 12:
+        runPatchInverseSearch<12>(nstripes, num_iter, pyr_level);
+        break;
+    default:
+        runPatchInverseSearch<0>(nstripes, num_iter, pyr_level);
+        break;
+    }
 }
 
 DISOpticalFlowImpl::Densification_ParBody::Densification_ParBody(DISOpticalFlowImpl &_dis, int _nstripes, int _h,
                                                                  Mat &dst_Ux, Mat &dst_Uy, Mat &src_Sx, Mat &src_Sy,
-                                                                 Mat &_I0, Mat &_I1)
-    : dis(&_dis), nstripes(_nstripes), h(_h), Ux(&dst_Ux), Uy(&dst_Uy), Sx(&src_Sx), Sy(&src_Sy), I0(&_I0), I1(&_I1)
+                                                                 Mat &_I0, Mat &_I1, int _pyr_level)
+    : dis(&_dis), nstripes(_nstripes), h(_h), Ux(&dst_Ux), Uy(&dst_Uy), Sx(&src_Sx), Sy(&src_Sy), I0(&_I0), I1(&_I1),
+      pyr_level(_pyr_level)
 {
     stripe_sz = (int)ceil(h / (double)nstripes);
 }
@@ -932,6 +2699,22 @@ void DISOpticalFlowImpl::Densification_ParBody::operator()(const Range &range) c
 
     uchar *I0_ptr = I0->ptr<uchar>();
     uchar *I1_ptr = I1->ptr<uchar>();
+    const int I0_step = (int)I0->step1();
+    const int I1_step = (int)I1->step1();
+
+    /* Only the patches inside the region of interest contribute. The locations they don't cover are set to zero, or to
+     * the initial flow for static tiles when it is available. The locations outside the bounding box of their supports
+     * are filled without visiting the patches.
+     */
+    const uchar *mask_ptr = dis->use_roi_mask ? dis->patch_mask.ptr<uchar>() : NULL;
+    const Rect roi = mask_ptr ? dis->level_roi : Rect(0, 0, dis->w, h);
+    const int roi_end_j = roi.x + roi.width;
+    const float *fill_Ux_ptr = NULL, *fill_Uy_ptr = NULL;
+    if (mask_ptr && dis->use_static_tiles && dis->use_initial_flow)
+    {
+        fill_Ux_ptr = dis->initial_Ux[pyr_level].ptr<float>();
+        fill_Uy_ptr = dis->initial_Uy[pyr_level].ptr<float>();
+    }
 
     int psz = dis->patch_size;
     int pstr = dis->patch_stride;
@@ -957,6 +2740,19 @@ void DISOpticalFlowImpl::Densification_ParBody::operator()(const Range &range) c
     if (j - psz >= 0 && (j - psz) % pstr == 0 && start_js < end_js)                                                    \
         start_js++;
 
+/* Fills n dense flow values starting at the given offset for the locations no patch covers */
+#define FILL_UNCOVERED(ofs, n)                                                                                         \
+    if (fill_Ux_ptr)                                                                                                   \
+    {                                                                                                                  \
+        memcpy(Ux_ptr + (ofs), fill_Ux_ptr + (ofs), (n) * sizeof(float));                                              \
+        memcpy(Uy_ptr + (ofs), fill_Uy_ptr + (ofs), (n) * sizeof(float));                                              \
+    }                                                                                                                  \
+    else                                                                                                               \
+    {                                                                                                                  \
+        memset(Ux_ptr + (ofs), 0, (n) * sizeof(float));                                                                \
+        memset(Uy_ptr + (ofs), 0, (n) * sizeof(float));                                                                \
+    }
+
     start_is = 0;
     end_is = -1;
     for (int i = 0; i < start_i; i++)
@@ -966,9 +2762,94 @@ void DISOpticalFlowImpl::Densification_ParBody::operator()(const Range &range) c
     for (int i = start_i; i < end_i; i++)
     {
         UPDATE_SPARSE_I_COORDINATES;
+        if (i < roi.y || i >= roi.y + roi.height)
+        {
+            FILL_UNCOVERED(i * dis->w, dis->w);
+            continue;
+        }
+        FILL_UNCOVERED(i * dis->w, roi.x);
+        FILL_UNCOVERED(i * dis->w + roi_end_j, dis->w - roi_end_j);
         start_js = 0;
         end_js = -1;
-        for (int j = 0; j < dis->w; j++)
+        int j = 0;
+        for (; j < roi.x; j++)
+        {
+            UPDATE_SPARSE_J_COORDINATES;
+        }
+#if CV_SIMD128
+        v_float32x4 zero = v_setall_f32(0.0f);
+        v_float32x4 one = v_setall_f32(1.0f);
+        v_float32x4 j_upper_limit = v_setall_f32(dis->w - 1.0f - EPS);
+        for (; j <= roi_end_j - 4;)
+        {
+            /* Process 4 neighbouring pixels at once, one per vector lane. The set of overlapping patches is tracked for
+             * every lane exactly as in the scalar loop below; the union of these sets is iterated and the patches that
+             * don't belong to the set of a lane get zero weight in that lane.
+             */
+            int j0 = j;
+            int lane_start_js[4], lane_end_js[4];
+            for (int k = 0; k < 4; k++, j++)
+            {
+                UPDATE_SPARSE_J_COORDINATES;
+                lane_start_js[k] = start_js;
+                lane_end_js[k] = end_js;
+            }
+            v_int32x4 lane_start_js_v = v_load(lane_start_js);
+            v_int32x4 lane_end_js_v = v_load(lane_end_js);
+
+            v_float32x4 jv((float)j0, (float)(j0 + 1), (float)(j0 + 2), (float)(j0 + 3));
+            v_float32x4 I0_v = v_cvt_f32(v_reinterpret_as_s32(v_load_expand_q(I0_ptr + i * I0_step + j0)));
+            v_float32x4 sum_Ux_v = zero, sum_Uy_v = zero, sum_coef_v = zero;
+            int j_l_buf[4];
+
+            for (int is = start_is; is <= end_is; is++)
+                for (int js = lane_start_js[0]; js <= lane_end_js[3]; js++)
+                {
+                    if (mask_ptr && !mask_ptr[is * dis->ws + js])
+                        continue;
+                    float Sx_val = Sx_ptr[is * dis->ws + js];
+                    float Sy_val = Sy_ptr[is * dis->ws + js];
+                    i_m = min(max(i + Sy_val, 0.0f), dis->h - 1.0f - EPS);
+                    i_l = (int)i_m;
+                    i_u = i_l + 1;
+                    const uchar *I1_row_l = I1_ptr + i_l * I1_step;
+                    const uchar *I1_row_u = I1_ptr + i_u * I1_step;
+
+                    v_float32x4 j_m_v = v_min(v_max(jv + v_setall_f32(Sx_val), zero), j_upper_limit);
+                    v_int32x4 j_l_v = v_trunc(j_m_v);
+                    v_store(j_l_buf, j_l_v);
+                    v_float32x4 I1_ll(I1_row_l[j_l_buf[0]], I1_row_l[j_l_buf[1]], I1_row_l[j_l_buf[2]],
+                                      I1_row_l[j_l_buf[3]]);
+                    v_float32x4 I1_lu(I1_row_l[j_l_buf[0] + 1], I1_row_l[j_l_buf[1] + 1], I1_row_l[j_l_buf[2] + 1],
+                                      I1_row_l[j_l_buf[3] + 1]);
+                    v_float32x4 I1_ul(I1_row_u[j_l_buf[0]], I1_row_u[j_l_buf[1]], I1_row_u[j_l_buf[2]],
+                                      I1_row_u[j_l_buf[3]]);
+                    v_float32x4 I1_uu(I1_row_u[j_l_buf[0] + 1], I1_row_u[j_l_buf[1] + 1], I1_row_u[j_l_buf[2] + 1],
+                                      I1_row_u[j_l_buf[3] + 1]);
+
+                    v_float32x4 dj_l = j_m_v - v_cvt_f32(j_l_v);                       //!< j_m - j_l
+                    v_float32x4 dj_u = v_cvt_f32(j_l_v + v_setall_s32(1)) - j_m_v;    //!< j_u - j_m
+                    v_float32x4 di_l = v_setall_f32(i_m - i_l);                        //!< i_m - i_l
+                    v_float32x4 di_u = v_setall_f32(i_u - i_m);                        //!< i_u - i_m
+                    v_float32x4 diff_v = dj_l * di_l * I1_uu + dj_u * di_l * I1_ul + dj_l * di_u * I1_lu +
+                                         dj_u * di_u * I1_ll - I0_v;
+
+                    v_int32x4 js_v = v_setall_s32(js);
+                    v_float32x4 lane_mask =
+                      v_reinterpret_as_f32((lane_start_js_v <= js_v) & (js_v <= lane_end_js_v));
+                    v_float32x4 coef_v = (one / v_max(one, v_abs(diff_v))) & lane_mask;
+                    sum_Ux_v += coef_v * v_setall_f32(Sx_val);
+                    sum_Uy_v += coef_v * v_setall_f32(Sy_val);
+                    sum_coef_v += coef_v;
+                }
+            v_float32x4 covered = sum_coef_v > zero;
+            v_float32x4 fill_Ux_v = fill_Ux_ptr ? v_load(fill_Ux_ptr + i * dis->w + j0) : zero;
+            v_float32x4 fill_Uy_v = fill_Uy_ptr ? v_load(fill_Uy_ptr + i * dis->w + j0) : zero;
+            v_store(Ux_ptr + i * dis->w + j0, v_select(covered, sum_Ux_v / sum_coef_v, fill_Ux_v));
+            v_store(Uy_ptr + i * dis->w + j0, v_select(covered, sum_Uy_v / sum_coef_v, fill_Uy_v));
+        }
+#endif
+        for (; j < roi_end_j; j++)
         {
             UPDATE_SPARSE_J_COORDINATES;
             float coef, sum_coef = 0.0f;
@@ -979,31 +2860,1067 @@ void DISOpticalFlowImpl::Densification_ParBody::operator()(const Range &range) c
             for (int is = start_is; is <= end_is; is++)
                 for (int js = start_js; js <= end_js; js++)
                 {
+                    if (mask_ptr && !mask_ptr[is * dis->ws + js])
+                        continue;
                     j_m = min(max(j + Sx_ptr[is * dis->ws + js], 0.0f), dis->w - 1.0f - EPS);
                     i_m = min(max(i + Sy_ptr[is * dis->ws + js], 0.0f), dis->h - 1.0f - EPS);
                     j_l = (int)j_m;
                     j_u = j_l + 1;
                     i_l = (int)i_m;
                     i_u = i_l + 1;
-                    diff = (j_m - j_l) * (i_m - i_l) * I1_ptr[i_u * dis->w + j_u] +
-                           (j_u - j_m) * (i_m - i_l) * I1_ptr[i_u * dis->w + j_l] +
-                           (j_m - j_l) * (i_u - i_m) * I1_ptr[i_l * dis->w + j_u] +
-                           (j_u - j_m) * (i_u - i_m) * I1_ptr[i_l * dis->w + j_l] - I0_ptr[i * dis->w + j];
+                    diff = (j_m - j_l) * (i_m - i_l) * I1_ptr[i_u * I1_step + j_u] +
+                           (j_u - j_m) * (i_m - i_l) * I1_ptr[i_u * I1_step + j_l] +
+                           (j_m - j_l) * (i_u - i_m) * I1_ptr[i_l * I1_step + j_u] +
+                           (j_u - j_m) * (i_u - i_m) * I1_ptr[i_l * I1_step + j_l] - I0_ptr[i * I0_step + j];
                     coef = 1 / max(1.0f, abs(diff));
                     sum_Ux += coef * Sx_ptr[is * dis->ws + js];
                     sum_Uy += coef * Sy_ptr[is * dis->ws + js];
                     sum_coef += coef;
                 }
-            CV_DbgAssert(sum_coef != 0);
-            Ux_ptr[i * dis->w + j] = sum_Ux / sum_coef;
-            Uy_ptr[i * dis->w + j] = sum_Uy / sum_coef;
+            CV_DbgAssert(mask_ptr || sum_coef != 0);
+            if (sum_coef > 0)
+            {
+                Ux_ptr[i * dis->w + j] = sum_Ux / sum_coef;
+                Uy_ptr[i * dis->w + j] = sum_Uy / sum_coef;
+            }
+            else
+            {
+                Ux_ptr[i * dis->w + j] = fill_Ux_ptr ? fill_Ux_ptr[i * dis->w + j] : 0.0f;
+                Uy_ptr[i * dis->w + j] = fill_Uy_ptr ? fill_Uy_ptr[i * dis->w + j] : 0.0f;
+            }
         }
     }
 #undef UPDATE_SPARSE_I_COORDINATES
 #undef UPDATE_SPARSE_J_COORDINATES
+#undef FILL_UNCOVERED
+}
+
+DISOpticalFlowImpl::FlowUpscale_ParBody::FlowUpscale_ParBody(DISOpticalFlowImpl &_dis, int _nstripes, Mat &_src_Ux,
+                                                             Mat &_src_Uy, Mat &_dst, float _mul)
+    : dis(&_dis), nstripes(_nstripes), src_Ux(&_src_Ux), src_Uy(&_src_Uy), dst(&_dst), dst_Ux(NULL), dst_Uy(NULL),
+      mul(_mul)
+{
+    init();
+}
+
+DISOpticalFlowImpl::FlowUpscale_ParBody::FlowUpscale_ParBody(DISOpticalFlowImpl &_dis, int _nstripes, Mat &_src_Ux,
+                                                             Mat &_src_Uy, Mat &_dst_Ux, Mat &_dst_Uy, float _mul)
+    : dis(&_dis), nstripes(_nstripes), src_Ux(&_src_Ux), src_Uy(&_src_Uy), dst(NULL), dst_Ux(&_dst_Ux),
+      dst_Uy(&_dst_Uy), mul(_mul)
+{
+    init();
+}
+
+void DISOpticalFlowImpl::FlowUpscale_ParBody::init()
+{
+    int dst_w = dst ? dst->cols : dst_Ux->cols;
+    int dst_h = dst ? dst->rows : dst_Ux->rows;
+    stripe_sz = (int)ceil(dst_h / (double)nstripes);
+
+    /* Same-size flow is only scaled and interleaved, which is done for the final output only */
+    CV_Assert(dst || src_Ux->size() != dst_Ux->size());
+
+    /* The horizontal sampling is the same for all the rows, so it is tabulated once: */
+    int src_w = src_Ux->cols;
+    double scale_x = (double)src_w / dst_w;
+    int *xofs = dis->upscale_xofs.ptr<int>();
+    float *alpha = dis->upscale_alpha.ptr<float>();
+    for (int j = 0; j < dst_w; j++)
+    {
+        float fx = (float)((j + 0.5) * scale_x - 0.5);
+        int sx = cvFloor(fx);
+        fx -= sx;
+        if (sx < 0)
+        {
+            sx = 0;
+            fx = 0;
+        }
+        if (sx >= src_w - 1)
+        {
+            sx = src_w - 1;
+            fx = 0;
+        }
+        xofs[j] = sx;
+        alpha[j] = fx;
+    }
+}
+
+void DISOpticalFlowImpl::FlowUpscale_ParBody::operator()(const Range &range) const
+{
+    CV_INSTRUMENT_REGION();
+
+    int src_w = src_Ux->cols, src_h = src_Ux->rows;
+    int dst_w = dst ? dst->cols : dst_Ux->cols;
+    int dst_h = dst ? dst->rows : dst_Ux->rows;
+    int start_i = min(range.start * stripe_sz, dst_h);
+    int end_i = min(range.end * stripe_sz, dst_h);
+
+    if (src_w == dst_w && src_h == dst_h)
+    {
+        /* No upscaling (finest_scale == 0): only scale and interleave the components */
+        for (int i = start_i; i < end_i; i++)
+        {
+            const float *Ux_row = src_Ux->ptr<float>(i);
+            const float *Uy_row = src_Uy->ptr<float>(i);
+            float *dst_row = dst->ptr<float>(i);
+            int j = 0;
+#if CV_SIMD128
+            v_float32x4 mulv = v_setall_f32(mul);
+            for (; j <= dst_w - 4; j += 4)
+                v_store_interleave(dst_row + 2 * j, v_load(Ux_row + j) * mulv, v_load(Uy_row + j) * mulv);
+#endif
+            for (; j < dst_w; j++)
+            {
+                dst_row[2 * j] = Ux_row[j] * mul;
+                dst_row[2 * j + 1] = Uy_row[j] * mul;
+            }
+        }
+        return;
+    }
+
+    const int *xofs = dis->upscale_xofs.ptr<int>();
+    const float *alpha = dis->upscale_alpha.ptr<float>();
+    double scale_y = (double)src_h / dst_h;
+
+    /* Vertically interpolated source rows, padded by one element for the right border (which has zero weight): */
+    float *row_Ux = (float *)dis->scratch_buf.ptr(range.start);
+    float *row_Uy = row_Ux + src_w + 1;
+
+    for (int i = start_i; i < end_i; i++)
+    {
+        float fy = (float)((i + 0.5) * scale_y - 0.5);
+        int sy = cvFloor(fy);
+        fy -= sy;
+        if (sy < 0)
+        {
+            sy = 0;
+            fy = 0;
+        }
+        if (sy >= src_h - 1)
+        {
+            sy = src_h - 1;
+            fy = 0;
+        }
+        int sy1 = min(sy + 1, src_h - 1);
+
+        /* Vertical pass, with the flow scaling folded into the weights: */
+        float b0 = (1 - fy) * mul, b1 = fy * mul;
+        const float *Ux_row0 = src_Ux->ptr<float>(sy), *Ux_row1 = src_Ux->ptr<float>(sy1);
+        const float *Uy_row0 = src_Uy->ptr<float>(sy), *Uy_row1 = src_Uy->ptr<float>(sy1);
+        int j = 0;
+#if CV_SIMD128
+        v_float32x4 b0v = v_setall_f32(b0), b1v = v_setall_f32(b1);
+        for (; j <= src_w - 4; j += 4)
+        {
+            v_store(row_Ux + j, b0v * v_load(Ux_row0 + j) + b1v * v_load(Ux_row1 + j));
+            v_store(row_Uy + j, b0v * v_load(Uy_row0 + j) + b1v * v_load(Uy_row1 + j));
+        }
+#endif
+        for (; j < src_w; j++)
+        {
+            row_Ux[j] = b0 * Ux_row0[j] + b1 * Ux_row1[j];
+            row_Uy[j] = b0 * Uy_row0[j] + b1 * Uy_row1[j];
+        }
+        row_Ux[src_w] = row_Ux[src_w - 1];
+        row_Uy[src_w] = row_Uy[src_w - 1];
+
+        /* Horizontal pass, writing both components at once: */
+        j = 0;
+        if (dst)
+        {
+            float *dst_row = dst->ptr<float>(i);
+#if CV_SIMD128
+            for (; j <= dst_w - 4; j += 4)
+            {
+                v_float32x4 a = v_load(alpha + j);
+                v_float32x4 Ux0 = v_lut(row_Ux, xofs + j), Ux1 = v_lut(row_Ux + 1, xofs + j);
+                v_float32x4 Uy0 = v_lut(row_Uy, xofs + j), Uy1 = v_lut(row_Uy + 1, xofs + j);
+                v_store_interleave(dst_row + 2 * j, v_muladd(a, Ux1 - Ux0, Ux0), v_muladd(a, Uy1 - Uy0, Uy0));
+            }
+#endif
+            for (; j < dst_w; j++)
+            {
+                float a = alpha[j];
+                int x = xofs[j];
+                dst_row[2 * j] = row_Ux[x] + a * (row_Ux[x + 1] - row_Ux[x]);
+                dst_row[2 * j + 1] = row_Uy[x] + a * (row_Uy[x + 1] - row_Uy[x]);
+            }
+        }
+        else
+        {
+            float *dst_Ux_row = dst_Ux->ptr<float>(i);
+            float *dst_Uy_row = dst_Uy->ptr<float>(i);
+#if CV_SIMD128
+            for (; j <= dst_w - 4; j += 4)
+            {
+                v_float32x4 a = v_load(alpha + j);
+                v_float32x4 Ux0 = v_lut(row_Ux, xofs + j), Ux1 = v_lut(row_Ux + 1, xofs + j);
+                v_float32x4 Uy0 = v_lut(row_Uy, xofs + j), Uy1 = v_lut(row_Uy + 1, xofs + j);
+                v_store(dst_Ux_row + j, v_muladd(a, Ux1 - Ux0, Ux0));
+                v_store(dst_Uy_row + j, v_muladd(a, Uy1 - Uy0, Uy0));
+            }
+#endif
+            for (; j < dst_w; j++)
+            {
+                float a = alpha[j];
+                int x = xofs[j];
+                dst_Ux_row[j] = row_Ux[x] + a * (row_Ux[x + 1] - row_Ux[x]);
+                dst_Uy_row[j] = row_Uy[x] + a * (row_Uy[x + 1] - row_Uy[x]);
+            }
+        }
+    }
+}
+
+/* Selects the coarsest scale for the given image size (adjusting the finest scale and the patch size if the image is
+ * too small for them)
+ */
+void DISOpticalFlowImpl::selectScales(Size img_size)
+{
+    coarsest_scale = min((int)(log(max(img_size.width, img_size.height) / (4.0 * patch_size)) / log(2.0) + 0.5), /* Original code search for maximal movement of width/4 */
+                         (int)(log(min(img_size.width, img_size.height) / patch_size) / log(2.0)));              /* Deepest pyramid level greater or equal than patch*/
+
+    if (coarsest_scale<0)
+        CV_Error(cv::Error::StsBadSize, "The input image must have either width or height >= 12");
+
+    if (coarsest_scale<finest_scale)
+    {
+        // choose the finest level based on coarsest level.
+        // Refs: https://github.com/tikroeger/OF_DIS/blob/2c9f2a674f3128d3a41c10e41cc9f3a35bb1b523/run_dense.cpp#L239
+        int original_img_width = img_size.width;
+        autoSelectPatchSizeAndScales(original_img_width);
+    }
+    search_coarsest_scale = coarsest_scale;
+}
+
+/* Runs the coarse-to-fine scheme on the prepared pyramids and writes the result into flow. If
+ * use_precomputed_tensors is set, the structure tensors of I0 are taken from I0_tensors instead of being recomputed.
+ */
+void DISOpticalFlowImpl::computeFlow(Mat &flowMat, bool use_precomputed_tensors)
+{
+    CV_INSTRUMENT_REGION();
+
+    int level = computeLevels(use_precomputed_tensors, true);
+    levels_end_tick = getTickCount();
+
+    int num_stripes = getNumThreads();
+    parallel_for_(Range(0, num_stripes),
+                  FlowUpscale_ParBody(*this, num_stripes, Ux[level], Uy[level], flowMat, (float)(1 << level)));
+    post_pass_ms = (getTickCount() - levels_end_tick) * 1000.0 / getTickFrequency();
+}
+
+/* Runs the pyramid levels from the coarsest to the finest scale and returns the level that holds the dense flow. If
+ * densify_finest is not set, the computation stops after the inverse search on the finest scale, leaving its result in
+ * Sx and Sy (and the finest scale sizes in w, h, ws and hs).
+ *
+ * With a time budget (dense flow only), the cost of every level is predicted from the previous one, which has 4 times
+ * fewer pixels. While the prediction exceeds the remaining time, the following degradations are applied in order and
+ * kept for the rest of the call: halving the gradient descent iterations, skipping the variational refinement and
+ * stopping at the current level, whose flow is then upscaled to the output. The densification is predicted per pixel
+ * from the last level that was actually densified (possibly in an earlier call). It is reserved for every level,
+ * including the ones carried sparsely, because it is also the cost of stopping at the next level. The passes that
+ * run after the last level (the upscaling to the output and, in the streaming mode, the warm start and the state of
+ * the next frame) are reserved as they took in the previous call; the first call of a sequence has no estimate for
+ * them yet and may overrun the budget by their time.
+ */
+int DISOpticalFlowImpl::computeLevels(bool use_precomputed_tensors, bool densify_finest)
+{
+    CV_INSTRUMENT_REGION();
+
+    int num_stripes = getNumThreads();
+
+    int top_scale = min(max(search_coarsest_scale, finest_scale), coarsest_scale);
+    Ux[top_scale].setTo(0.0f);
+    Uy[top_scale].setTo(0.0f);
+
+    grad_descent_hist.resize(coarsest_scale + 1);
+    for (int i = 0; i <= coarsest_scale; i++)
+        grad_descent_hist[i].clear();
+    pruned_patches.assign(coarsest_scale + 1, 0);
+
+    bool use_time_budget = densify_finest && time_budget > 0;
+    bool skip_refinement = false;
+    double search_ms = 0, refine_ms = 0; //!< measured costs of the previous level
+    applied_degradations = 0;
+    grad_descent_shift = 0;
+
+    bool sparse_init = false;
+    int coarse_ws = 0, coarse_hs = 0;
+    for (int i = top_scale; i >= finest_scale; i--)
+    {
+        CV_TRACE_REGION("coarsest_scale_iteration");
+        if (use_time_budget && i < top_scale)
+        {
+            double elapsed = (getTickCount() - budget_start_tick) * 1000.0 / getTickFrequency();
+            double remaining = time_budget - elapsed - post_pass_ms;
+            double search = 4 * search_ms, refine = 4 * refine_ms;
+            /* Until a densification has been measured, it is assumed to cost as much as the search */
+            double densify = densify_ms_per_pixel > 0 ? densify_ms_per_pixel * I0s[i].rows * I0s[i].cols : search;
+            if (search + densify + refine > remaining && !(applied_degradations & DISOpticalFlow::DEGRADE_GRAD_DESCENT))
+            {
+                applied_degradations |= DISOpticalFlow::DEGRADE_GRAD_DESCENT;
+                grad_descent_shift = 1;
+                search *= 0.5;
+            }
+            if (search + densify + refine > remaining && refine > 0)
+            {
+                applied_degradations |= DISOpticalFlow::DEGRADE_REFINEMENT;
+                skip_refinement = true;
+                refine = 0;
+            }
+            if (search + densify + refine > remaining)
+            {
+                applied_degradations |= DISOpticalFlow::DEGRADE_FINEST_SCALE;
+                /* Ux[i] already holds the upscaled flow of the previous level, unless that level was carried sparsely.
+                 * Then it still has to be densified (w, h, ws, hs, Sx, Sy and the patch mask are still its own). Its
+                 * predicted cost was reserved when the previous level was started.
+                 */
+                flow_level = i;
+                if (sparse_init)
+                {
+                    flow_level = i + 1;
+                    int64 densify_start = getTickCount();
+                    parallel_for_(Range(0, num_stripes),
+                                  Densification_ParBody(*this, num_stripes, I0s[i + 1].rows, Ux[i + 1], Uy[i + 1], Sx,
+                                                        Sy, I0s[i + 1], I1s[i + 1], i + 1));
+                    densify_ms_per_pixel = (getTickCount() - densify_start) * 1000.0 / getTickFrequency() /
+                                           ((double)I0s[i + 1].rows * I0s[i + 1].cols);
+                }
+                return flow_level;
+            }
+        }
+        int64 level_start = getTickCount();
+
+        w = I0s[i].cols;
+        h = I0s[i].rows;
+        ws = 1 + (w - patch_size) / patch_stride;
+        hs = 1 + (h - patch_size) / patch_stride;
+
+        use_sparse_init = sparse_init;
+        if (use_sparse_init)
+            upscaleSparseFlow(coarse_ws, coarse_hs);
+        if (use_roi_mask)
+            computePatchMask(i);
+
+        if (use_precomputed_tensors)
+        {
+            I0xx_buf = I0_tensors[i].rowRange(0, hs);
+            I0yy_buf = I0_tensors[i].rowRange(hs, 2 * hs);
+            I0xy_buf = I0_tensors[i].rowRange(2 * hs, 3 * hs);
+            I0x_buf = I0_tensors[i].rowRange(3 * hs, 4 * hs);
+            I0y_buf = I0_tensors[i].rowRange(4 * hs, 5 * hs);
+        }
+        else if (!use_roi_mask)
+            precomputeStructureTensor(I0xx_buf, I0yy_buf, I0xy_buf, I0x_buf, I0y_buf, I0xs[i], I0ys[i],
+                                      Rect(0, 0, w, h));
+        else if (!level_roi.empty())
+        {
+            /* The gradients (deferred by prepareBuffers) and the structure tensors are only computed for the supports
+             * of the active patches. The gradients get one more pixel on each side for the 3x3 Sobel kernels.
+             */
+            Rect grad_roi = Rect(level_roi.x - 1, level_roi.y - 1, level_roi.width + 2, level_roi.height + 2) &
+                            Rect(0, 0, w, h);
+            Mat_<short> I0x_roi = I0xs[i](grad_roi), I0y_roi = I0ys[i](grad_roi);
+            spatialGradient(I0s[i](grad_roi), I0x_roi, I0y_roi);
+            precomputeStructureTensor(I0xx_buf, I0yy_buf, I0xy_buf, I0x_buf, I0y_buf, I0xs[i], I0ys[i], level_roi);
+        }
+        if (use_spatial_propagation)
+        {
+            /* Use a fixed number of stripes regardless the number of threads to make inverse search
+             * with spatial propagation reproducible (the wavefront mode ignores it and is reproducible anyway)
+             */
+            patchInverseSearch(8, 2, i);
+        }
+        else
+        {
+            patchInverseSearch(num_stripes, 1, i);
+        }
+        if (i == finest_scale && !densify_finest)
+            break;
+        int64 search_end = getTickCount();
+        search_ms = (search_end - level_start) * 1000.0 / getTickFrequency();
+        refine_ms = 0;
+
+        if (i > finest_scale && variational_refinement_iter == 0)
+        {
+            /* Without variational refinement the dense flow of this level would only be sampled at the patch centers
+             * of the next level, so the sparse flow is carried over directly and densified on the finest scale only
+             */
+            sparse_init = true;
+            coarse_ws = ws;
+            coarse_hs = hs;
+            continue;
+        }
+
+        parallel_for_(Range(0, num_stripes),
+                      Densification_ParBody(*this, num_stripes, I0s[i].rows, Ux[i], Uy[i], Sx, Sy, I0s[i], I1s[i], i));
+        int64 densify_end = getTickCount();
+        densify_ms_per_pixel = (densify_end - search_end) * 1000.0 / getTickFrequency() / ((double)w * h);
+        if (variational_refinement_iter > 0 && !skip_refinement)
+        {
+            if (!use_roi_mask)
+                variational_refinement_processors[i]->calcUV(I0s[i], I1s[i], Ux[i], Uy[i]);
+            else if (!level_roi.empty())
+            {
+                /* Refine the bounding box of the region of interest only */
+                Mat_<float> Ux_roi = Ux[i](level_roi), Uy_roi = Uy[i](level_roi);
+                variational_refinement_processors[i]->calcUV(I0s[i](level_roi), I1s[i](level_roi), Ux_roi, Uy_roi);
+            }
+        }
+
+        refine_ms = (getTickCount() - densify_end) * 1000.0 / getTickFrequency();
+
+        if (i > finest_scale)
+            parallel_for_(Range(0, num_stripes),
+                          FlowUpscale_ParBody(*this, num_stripes, Ux[i], Uy[i], Ux[i - 1], Uy[i - 1], 2.0f));
+    }
+    flow_level = finest_scale;
+    return flow_level;
+}
+
+/* Initializes the sparse flow of the current level (ws x hs patches) from the sparse flow of the next coarser level
+ * (src_ws x src_hs patches), bilinearly interpolated at the patch centers. The patch centers are mapped between the
+ * levels in the same way as the dense flow is upscaled by resize().
+ */
+void DISOpticalFlowImpl::upscaleSparseFlow(int src_ws, int src_hs)
+{
+    CV_INSTRUMENT_REGION();
+
+    const float psz2 = (float)(patch_size / 2);
+    const float inv_stride = 1.0f / patch_stride;
+    const float *src_Sx = Sx.ptr<float>();
+    const float *src_Sy = Sy.ptr<float>();
+    float *dst_Sx = Sx_init.ptr<float>();
+    float *dst_Sy = Sy_init.ptr<float>();
+
+    for (int is = 0; is < hs; is++)
+    {
+        float gy = ((is * patch_stride + psz2 + 0.5f) * 0.5f - 0.5f - psz2) * inv_stride;
+        gy = min(max(gy, 0.0f), (float)(src_hs - 1));
+        int y0 = (int)gy;
+        int y1 = min(y0 + 1, src_hs - 1);
+        float fy = gy - y0;
+        for (int js = 0; js < ws; js++)
+        {
+            float gx = ((js * patch_stride + psz2 + 0.5f) * 0.5f - 0.5f - psz2) * inv_stride;
+            gx = min(max(gx, 0.0f), (float)(src_ws - 1));
+            int x0 = (int)gx;
+            int x1 = min(x0 + 1, src_ws - 1);
+            float fx = gx - x0;
+
+            float w00 = (1 - fy) * (1 - fx), w01 = (1 - fy) * fx, w10 = fy * (1 - fx), w11 = fy * fx;
+            dst_Sx[is * ws + js] = 2 * (w00 * src_Sx[y0 * src_ws + x0] + w01 * src_Sx[y0 * src_ws + x1] +
+                                        w10 * src_Sx[y1 * src_ws + x0] + w11 * src_Sx[y1 * src_ws + x1]);
+            dst_Sy[is * ws + js] = 2 * (w00 * src_Sy[y0 * src_ws + x0] + w01 * src_Sy[y0 * src_ws + x1] +
+                                        w10 * src_Sy[y1 * src_ws + x0] + w11 * src_Sy[y1 * src_ws + x1]);
+        }
+    }
+    std::swap(Sx, Sx_init);
+    std::swap(Sy, Sy_init);
+}
+
+/* Computes the integral image of the nonzero pixels of the region of interest mask */
+void DISOpticalFlowImpl::computeRoiIntegral(const Mat &mask)
+{
+    CV_INSTRUMENT_REGION();
+
+    roi_scale = 0;
+    int *sum_ptr = roi_integral.ptr<int>();
+    int sum_w = mask.cols + 1;
+    memset(sum_ptr, 0, sum_w * sizeof(int));
+    for (int i = 0; i < mask.rows; i++)
+    {
+        const uchar *mask_row = mask.ptr<uchar>(i);
+        const int *prev_row = sum_ptr + i * sum_w;
+        int *cur_row = sum_ptr + (i + 1) * sum_w;
+        int row_sum = 0;
+        cur_row[0] = 0;
+        for (int j = 0; j < mask.cols; j++)
+        {
+            row_sum += mask_row[j] != 0;
+            cur_row[j + 1] = prev_row[j + 1] + row_sum;
+        }
+    }
+}
+
+/* Pyramid level used for the change detection of the static tile skipping */
+int DISOpticalFlowImpl::staticTileLevel() const
+{
+    return min(finest_scale + 2, coarsest_scale);
+}
+
+/* Change detection for the static tile skipping: splits the pyramid level staticTileLevel() into tiles, marks the
+ * tiles whose mean absolute difference between I0 and I1 exceeds static_tile_threshold and stores the integral image
+ * of these marks in roi_integral (one cell per tile). The patches far enough from all the marked tiles are skipped
+ * and keep the flow they are initialized with.
+ */
+void DISOpticalFlowImpl::detectStaticTiles()
+{
+    CV_INSTRUMENT_REGION();
+
+    int level = staticTileLevel();
+    int tile = 1 << static_tile_size_log2;
+    roi_scale = level + static_tile_size_log2;
+    const Mat_<uchar> &I0_level = I0s[level];
+    const Mat_<uchar> &I1_level = I1s[level];
+    int cells_h = roi_integral.rows - 1, cells_w = roi_integral.cols - 1;
+
+    int *sum_ptr = roi_integral.ptr<int>();
+    int sum_w = cells_w + 1;
+    memset(sum_ptr, 0, sum_w * sizeof(int));
+    for (int ti = 0; ti < cells_h; ti++)
+    {
+        int i0 = ti * tile, i1 = min(i0 + tile, I0_level.rows);
+        const int *prev_row = sum_ptr + ti * sum_w;
+        int *cur_row = sum_ptr + (ti + 1) * sum_w;
+        int row_sum = 0;
+        cur_row[0] = 0;
+        for (int tj = 0; tj < cells_w; tj++)
+        {
+            int j0 = tj * tile, j1 = min(j0 + tile, I0_level.cols);
+            int sad = 0;
+            for (int i = i0; i < i1; i++)
+            {
+                const uchar *I0_row = I0_level.ptr<uchar>(i);
+                const uchar *I1_row = I1_level.ptr<uchar>(i);
+                for (int j = j0; j < j1; j++)
+                    sad += abs(I0_row[j] - I1_row[j]);
+            }
+            /* Tiles that are empty on this level (the input size isn't divisible by the tile size) count as changed */
+            int area = (i1 - i0) * (j1 - j0);
+            row_sum += area <= 0 || sad > static_tile_threshold * area;
+            cur_row[tj + 1] = prev_row[tj + 1] + row_sum;
+        }
+    }
+}
+
+/* Marks the patches of the current level whose support, extended by a margin of patch_size pixels of this level,
+ * overlaps the region of interest. The margin is constant in the pixels of the level, so it grows at the coarser
+ * levels, where the flow vectors are propagated further. Also computes level_roi.
+ */
+void DISOpticalFlowImpl::computePatchMask(int level)
+{
+    CV_INSTRUMENT_REGION();
+
+    const int margin = patch_size;
+    const int fraction = 1 << level;
+    const int cell = 1 << roi_scale;
+    int cells_h = roi_integral.rows - 1, cells_w = roi_integral.cols - 1;
+    uchar *mask_ptr = patch_mask.ptr<uchar>();
+    int min_is = hs, max_is = -1, min_js = ws, max_js = -1;
+    int num_active = 0;
+    for (int is = 0; is < hs; is++)
+    {
+        /* Support of the patch in the input pixels, rounded outwards to the cells of the mask */
+        int r0 = min(max((is * patch_stride - margin) * fraction, 0) / cell, cells_h);
+        int r1 = min((max((is * patch_stride + patch_size + margin) * fraction, 0) + cell - 1) / cell, cells_h);
+        const int *top = roi_integral.ptr<int>(r0);
+        const int *bottom = roi_integral.ptr<int>(r1);
+        for (int js = 0; js < ws; js++)
+        {
+            int c0 = min(max((js * patch_stride - margin) * fraction, 0) / cell, cells_w);
+            int c1 = min((max((js * patch_stride + patch_size + margin) * fraction, 0) + cell - 1) / cell, cells_w);
+            bool active = bottom[c1] - bottom[c0] - top[c1] + top[c0] > 0;
+            mask_ptr[is * ws + js] = (uchar)active;
+            if (active)
+            {
+                num_active++;
+                min_is = min(min_is, is);
+                max_is = max(max_is, is);
+                min_js = min(min_js, js);
+                max_js = max(max_js, js);
+            }
+        }
+    }
+    if (level == finest_scale)
+        skipped_fraction = 1.0f - num_active / (float)(hs * ws);
+    if (max_is < 0)
+        level_roi = Rect();
+    else
+        level_roi = Rect(min_js * patch_stride, min_is * patch_stride, (max_js - min_js) * patch_stride + patch_size,
+                         (max_is - min_is) * patch_stride + patch_size);
+}
+
+void DISOpticalFlowImpl::calc(InputArray I0, InputArray I1, InputOutputArray flow)
+{
+    calc(I0, I1, flow, noArray());
+}
+
+void DISOpticalFlowImpl::calc(InputArray I0, InputArray I1, InputOutputArray flow, InputArray roiMask)
+{
+    CV_INSTRUMENT_REGION();
+
+    budget_start_tick = getTickCount();
+    CV_Assert(!I0.empty() && I0.depth() == CV_8U && isSupportedChannels(I0.channels()));
+    CV_Assert(!I1.empty() && I1.depth() == CV_8U && isSupportedChannels(I1.channels()));
+    CV_Assert(I0.sameSize(I1));
+
+    Mat I0Mat = I0.getMat();
+    Mat I1Mat = I1.getMat();
+    bool use_input_flow = false;
+    if (flow.sameSize(I0) && flow.depth() == CV_32F && flow.channels() == 2)
+        use_input_flow = true;
+    else
+        flow.create(I1Mat.size(), CV_32FC2);
+    Mat flowMat = flow.getMat();
+    selectScales(I0Mat.size());
+
+    /* A user mask takes precedence over the static tile detection */
+    int roi_mode = !roiMask.empty() ? ROI_MASK : static_tile_threshold > 0 ? ROI_STATIC_TILES : ROI_NONE;
+    if (roi_mode == ROI_MASK)
+        CV_Assert(roiMask.sameSize(I0) && roiMask.type() == CV_8UC1);
+    use_roi_mask = roi_mode != ROI_NONE;
+    use_static_tiles = roi_mode == ROI_STATIC_TILES;
+    skipped_fraction = 0.0f;
+
+    /* The pyramids are overwritten, so the next calcNext call has to start a new stream */
+    stream_ready = false;
+    allocateBuffers(I0Mat.size(), use_input_flow, false, roi_mode, inputPitch(I0Mat, I1Mat));
+    if (roi_mode == ROI_MASK)
+        computeRoiIntegral(roiMask.getMat());
+    prepareBuffers(I0Mat, I1Mat, flowMat, use_input_flow);
+    if (roi_mode == ROI_STATIC_TILES)
+        detectStaticTiles();
+    computeFlow(flowMat, false);
+}
+
+/* Computes the dense flow at the location (i, j) of the finest scale from the sparse flow in Sx and Sy, in the same way
+ * as Densification_ParBody does: a weighted average of the flow vectors of all the patches that contain the location
+ */
+void DISOpticalFlowImpl::densifyLocation(float &dst_Ux, float &dst_Uy, int i, int j)
+{
+    const uchar *I0_ptr = I0s[finest_scale].ptr<uchar>();
+    const uchar *I1_ptr = I1s[finest_scale].ptr<uchar>();
+    const int I0_step = (int)I0s[finest_scale].step1();
+    const int I1_step = (int)I1s[finest_scale].step1();
+    const float *Sx_ptr = Sx.ptr<float>();
+    const float *Sy_ptr = Sy.ptr<float>();
+
+    /* Patches overlapping the location; the locations beyond the last patch use the last patch only */
+    int end_is = min(i / patch_stride, hs - 1);
+    int end_js = min(j / patch_stride, ws - 1);
+    int start_is = min(max((i - patch_size + patch_stride) / patch_stride, 0), end_is);
+    int start_js = min(max((j - patch_size + patch_stride) / patch_stride, 0), end_js);
+
+    float sum_coef = 0.0f, sum_Ux = 0.0f, sum_Uy = 0.0f;
+    for (int is = start_is; is <= end_is; is++)
+        for (int js = start_js; js <= end_js; js++)
+        {
+            float j_m = min(max(j + Sx_ptr[is * ws + js], 0.0f), w - 1.0f - EPS);
+            float i_m = min(max(i + Sy_ptr[is * ws + js], 0.0f), h - 1.0f - EPS);
+            int j_l = (int)j_m;
+            int j_u = j_l + 1;
+            int i_l = (int)i_m;
+            int i_u = i_l + 1;
+            float diff = (j_m - j_l) * (i_m - i_l) * I1_ptr[i_u * I1_step + j_u] +
+                         (j_u - j_m) * (i_m - i_l) * I1_ptr[i_u * I1_step + j_l] +
+                         (j_m - j_l) * (i_u - i_m) * I1_ptr[i_l * I1_step + j_u] +
+                         (j_u - j_m) * (i_u - i_m) * I1_ptr[i_l * I1_step + j_l] - I0_ptr[i * I0_step + j];
+            float coef = 1 / max(1.0f, abs(diff));
+            sum_Ux += coef * Sx_ptr[is * ws + js];
+            sum_Uy += coef * Sy_ptr[is * ws + js];
+            sum_coef += coef;
+        }
+    dst_Ux = sum_Ux / sum_coef;
+    dst_Uy = sum_Uy / sum_coef;
+}
+
+/* Computes the flow of the patches of the finest scale only: patch_flow is a hs x ws CV_32FC2 matrix with the flow of
+ * the patch with the top-left corner at (is * patch_stride, js * patch_stride) on the finest scale (i.e. at
+ * ((is * patch_stride) << finest_scale, (js * patch_stride) << finest_scale) in I0), in the pixels of I0. The
+ * computation stops before the densification and the variational refinement of the finest scale. If patch_ssd is
+ * requested, it receives the (mean-normalized, if enabled) SSD of every patch at its final flow vector, CV_32FC1.
+ */
+void DISOpticalFlowImpl::calcPatchFlow(InputArray I0, InputArray I1, OutputArray patch_flow, OutputArray patch_ssd)
+{
+    CV_INSTRUMENT_REGION();
+
+    CV_Assert(!I0.empty() && I0.depth() == CV_8U && isSupportedChannels(I0.channels()));
+    CV_Assert(!I1.empty() && I1.depth() == CV_8U && isSupportedChannels(I1.channels()));
+    CV_Assert(I0.sameSize(I1));
+
+    Mat I0Mat = I0.getMat();
+    Mat I1Mat = I1.getMat();
+    selectScales(I0Mat.size());
+
+    use_roi_mask = use_static_tiles = false;
+    skipped_fraction = 0.0f;
+    stream_ready = false;
+    allocateBuffers(I0Mat.size(), false, false, ROI_NONE, inputPitch(I0Mat, I1Mat));
+    Mat no_flow;
+    prepareBuffers(I0Mat, I1Mat, no_flow, false);
+    computeLevels(false, false);
+
+    float fraction = (float)(1 << finest_scale);
+    patch_flow.create(hs, ws, CV_32FC2);
+    Mat patch_flow_mat = patch_flow.getMat();
+    for (int is = 0; is < hs; is++)
+    {
+        const float *Sx_row = Sx.ptr<float>() + is * ws;
+        const float *Sy_row = Sy.ptr<float>() + is * ws;
+        float *dst_row = patch_flow_mat.ptr<float>(is);
+        for (int js = 0; js < ws; js++)
+        {
+            dst_row[2 * js] = fraction * Sx_row[js];
+            dst_row[2 * js + 1] = fraction * Sy_row[js];
+        }
+    }
+
+    if (!patch_ssd.needed())
+        return;
+    patch_ssd.create(hs, ws, CV_32FC1);
+    Mat patch_ssd_mat = patch_ssd.getMat();
+    uchar *I0_ptr = I0s[finest_scale].ptr<uchar>();
+    uchar *I1_ptr = I1s[finest_scale].ptr<uchar>();
+    uchar *edge_buf = scratch_buf.ptr(0);
+    int I0_step = (int)I0s[finest_scale].step1();
+    int I1_step = (int)I1s[finest_scale].step1();
+    for (int is = 0; is < hs; is++)
+    {
+        float *dst_row = patch_ssd_mat.ptr<float>(is);
+        for (int js = 0; js < ws; js++)
+        {
+            int i = is * patch_stride, j = js * patch_stride;
+            float i_I1 = min(max(i + Sy.ptr<float>()[is * ws + js], 1.0f - patch_size), h - 1.0f);
+            float j_I1 = min(max(j + Sx.ptr<float>()[is * ws + js], 1.0f - patch_size), w - 1.0f);
+            float di = i_I1 - floor(i_I1);
+            float dj = j_I1 - floor(j_I1);
+            int I1_stride;
+            uchar *I1_patch_ptr = fetchFootprint(I1_stride, I1_ptr, I1_step, h, w, cvFloor(i_I1), cvFloor(j_I1),
+                                                 patch_size, edge_buf);
+            float w00 = (1 - di) * (1 - dj), w01 = (1 - di) * dj, w10 = di * (1 - dj), w11 = di * dj;
+            if (use_mean_normalization)
+                dst_row[js] = computeSSDMeanNorm(I0_ptr + i * I0_step + j, I1_patch_ptr, I0_step, I1_stride, w00, w01,
+                                                 w10, w11, patch_size);
+            else
+                dst_row[js] = computeSSD(I0_ptr + i * I0_step + j, I1_patch_ptr, I0_step, I1_stride, w00, w01, w10,
+                                         w11, patch_size);
+        }
+    }
+}
+
+void DISOpticalFlowImpl::calcSparse(InputArray I0, InputArray I1, InputArray points, OutputArray outFlow)
+{
+    CV_INSTRUMENT_REGION();
+
+    CV_Assert(!I0.empty() && I0.depth() == CV_8U && isSupportedChannels(I0.channels()));
+    CV_Assert(!I1.empty() && I1.depth() == CV_8U && isSupportedChannels(I1.channels()));
+    CV_Assert(I0.sameSize(I1));
+
+    Mat I0Mat = I0.getMat();
+    Mat I1Mat = I1.getMat();
+    Mat pointsMat = points.getMat();
+    int num_points = pointsMat.checkVector(2, CV_32F, true);
+    CV_Assert(num_points >= 0);
+    selectScales(I0Mat.size());
+
+    use_roi_mask = use_static_tiles = false;
+    skipped_fraction = 0.0f;
+    stream_ready = false;
+    allocateBuffers(I0Mat.size(), false, false, ROI_NONE, inputPitch(I0Mat, I1Mat));
+    Mat no_flow;
+    prepareBuffers(I0Mat, I1Mat, no_flow, false);
+
+    /* The finest scale is neither densified nor refined: the flow is only evaluated around the requested points */
+    computeLevels(false, false);
+
+    outFlow.create(num_points, 1, CV_32FC2);
+    Mat outFlowMat = outFlow.getMat();
+    const Point2f *points_ptr = pointsMat.ptr<Point2f>();
+    Point2f *dst_ptr = outFlowMat.ptr<Point2f>();
+    float fraction = (float)(1 << finest_scale);
+    for (int k = 0; k < num_points; k++)
+    {
+        /* Same sampling of the finest scale as in the upscaling of the dense flow to the input resolution */
+        float x = min(max((points_ptr[k].x + 0.5f) / fraction - 0.5f, 0.0f), w - 1.0f);
+        float y = min(max((points_ptr[k].y + 0.5f) / fraction - 0.5f, 0.0f), h - 1.0f);
+        int x0 = (int)x, y0 = (int)y;
+        int x1 = min(x0 + 1, w - 1), y1 = min(y0 + 1, h - 1);
+        float fx = x - x0, fy = y - y0;
+
+        float Ux00, Uy00, Ux01, Uy01, Ux10, Uy10, Ux11, Uy11;
+        densifyLocation(Ux00, Uy00, y0, x0);
+        densifyLocation(Ux01, Uy01, y0, x1);
+        densifyLocation(Ux10, Uy10, y1, x0);
+        densifyLocation(Ux11, Uy11, y1, x1);
+        float w00 = (1 - fy) * (1 - fx), w01 = (1 - fy) * fx, w10 = fy * (1 - fx), w11 = fy * fx;
+        dst_ptr[k].x = fraction * (w00 * Ux00 + w01 * Ux01 + w10 * Ux10 + w11 * Ux11);
+        dst_ptr[k].y = fraction * (w00 * Uy00 + w01 * Uy01 + w10 * Uy10 + w11 * Uy11);
+    }
+}
+
+/* Computes the gradients and the structure tensors of the last frame (I1s) on every used pyramid level, so that they
+ * can be used as the I0 ones in the next calcNext call
+ */
+void DISOpticalFlowImpl::prepareNextFrame()
+{
+    CV_INSTRUMENT_REGION();
+
+    for (int i = finest_scale; i <= coarsest_scale; i++)
+    {
+        w = I1s[i].cols;
+        h = I1s[i].rows;
+        ws = 1 + (w - patch_size) / patch_stride;
+        hs = 1 + (h - patch_size) / patch_stride;
+
+        spatialGradient(I1s[i], I1xs[i], I1ys[i]);
+
+        Mat xx = I1_tensors[i].rowRange(0, hs);
+        Mat yy = I1_tensors[i].rowRange(hs, 2 * hs);
+        Mat xy = I1_tensors[i].rowRange(2 * hs, 3 * hs);
+        Mat x = I1_tensors[i].rowRange(3 * hs, 4 * hs);
+        Mat y = I1_tensors[i].rowRange(4 * hs, 5 * hs);
+        precomputeStructureTensor(xx, yy, xy, x, y, I1xs[i], I1ys[i], Rect(0, 0, w, h));
+    }
 }
 
+DISOpticalFlowImpl::FlowWarp_ParBody::FlowWarp_ParBody(int _nstripes, Mat &_src_Ux, Mat &_src_Uy, Mat &_dst_Ux,
+                                                       Mat &_dst_Uy)
+    : nstripes(_nstripes), src_Ux(&_src_Ux), src_Uy(&_src_Uy), dst_Ux(&_dst_Ux), dst_Uy(&_dst_Uy)
+{
+    h = src_Ux->rows;
+    w = src_Ux->cols;
+    stripe_sz = (int)ceil(h / (double)nstripes);
+}
 
+void DISOpticalFlowImpl::FlowWarp_ParBody::operator()(const Range &range) const
+{
+    CV_INSTRUMENT_REGION();
+
+    int start_i = min(range.start * stripe_sz, h);
+    int end_i = min(range.end * stripe_sz, h);
 
+    const float *Ux_ptr = src_Ux->ptr<float>();
+    const float *Uy_ptr = src_Uy->ptr<float>();
+    float i_upper_limit = h - 1.0f - EPS;
+    float j_upper_limit = w - 1.0f - EPS;
+    for (int i = start_i; i < end_i; i++)
+    {
+        float *dst_Ux_row = dst_Ux->ptr<float>(i);
+        float *dst_Uy_row = dst_Uy->ptr<float>(i);
+        for (int j = 0; j < w; j++)
+        {
+            float u = Ux_ptr[i * w + j];
+            float v = Uy_ptr[i * w + j];
+            for (int k = 0; k < warm_start_warp_iter; k++)
+            {
+                float i_m = min(max(i - v, 0.0f), i_upper_limit);
+                float j_m = min(max(j - u, 0.0f), j_upper_limit);
+                int i_l = (int)i_m;
+                int j_l = (int)j_m;
+                float di = i_m - i_l;
+                float dj = j_m - j_l;
+                int c = i_l * w + j_l;
+                u = (1 - di) * ((1 - dj) * Ux_ptr[c] + dj * Ux_ptr[c + 1]) +
+                    di * ((1 - dj) * Ux_ptr[c + w] + dj * Ux_ptr[c + w + 1]);
+                v = (1 - di) * ((1 - dj) * Uy_ptr[c] + dj * Uy_ptr[c + 1]) +
+                    di * ((1 - dj) * Uy_ptr[c + w] + dj * Uy_ptr[c + w + 1]);
+            }
+            dst_Ux_row[j] = u;
+            dst_Uy_row[j] = v;
+        }
+    }
+}
+
+/* Predicts the flow of the next frame pair of the stream from the flow just computed: the level that holds the dense
+ * flow (the finest one unless the time budget stopped earlier) is warped along itself and the other levels are
+ * resampled from it. The result is used as the initial flow of the next
+ * calcNext call, which makes it a temporal candidate of every patch.
+ */
+void DISOpticalFlowImpl::prepareWarmStart()
+{
+    CV_INSTRUMENT_REGION();
+
+    int num_stripes = getNumThreads();
+    int l = flow_level;
+    parallel_for_(Range(0, num_stripes), FlowWarp_ParBody(num_stripes, Ux[l], Uy[l], initial_Ux[l], initial_Uy[l]));
+    for (int i = l + 1; i <= coarsest_scale; i++)
+    {
+        resize(initial_Ux[i - 1], initial_Ux[i], initial_Ux[i].size(), 0.0, 0.0, INTER_AREA);
+        initial_Ux[i] *= 0.5f;
+        resize(initial_Uy[i - 1], initial_Uy[i], initial_Uy[i].size(), 0.0, 0.0, INTER_AREA);
+        initial_Uy[i] *= 0.5f;
+    }
+    for (int i = l - 1; i >= finest_scale; i--)
+    {
+        resize(initial_Ux[i + 1], initial_Ux[i], initial_Ux[i].size());
+        initial_Ux[i] *= 2.0f;
+        resize(initial_Uy[i + 1], initial_Uy[i], initial_Uy[i].size());
+        initial_Uy[i] *= 2.0f;
+    }
+    warm_start_ready = true;
+}
+
+/* Selects the coarsest level to search for the current frame pair of the stream: the lowest one where the largest
+ * flow component of the previous pair, multiplied by adaptive_scale_margin, is within half a patch. The whole pyramid
+ * is searched when the previous motion is unknown or the frames differ too much (a scene cut).
+ */
+int DISOpticalFlowImpl::adaptiveCoarsestScale()
+{
+    CV_INSTRUMENT_REGION();
+
+    if (prev_max_motion < 0)
+        return coarsest_scale;
+    const Mat_<uchar> &I0_top = I0s[coarsest_scale];
+    double mad = norm(I0_top, I1s[coarsest_scale], NORM_L1) / (double)(I0_top.rows * I0_top.cols);
+    if (mad > scene_cut_threshold)
+        return coarsest_scale;
+
+    float reach = 0.5f * patch_size;
+    int level = finest_scale;
+    while (level < coarsest_scale && adaptive_scale_margin * prev_max_motion > reach * (1 << level))
+        level++;
+    return level;
+}
+
+/* Records the largest flow component of the frame pair just computed, in input pixels */
+void DISOpticalFlowImpl::updateMotionStatistics()
+{
+    CV_INSTRUMENT_REGION();
+
+    double max_Ux = norm(Ux[flow_level], NORM_INF);
+    double max_Uy = norm(Uy[flow_level], NORM_INF);
+    prev_max_motion = (float)(max(max_Ux, max_Uy) * (1 << flow_level));
+}
+
+void DISOpticalFlowImpl::calcNext(InputArray nextFrame, InputOutputArray flow)
+{
+    CV_INSTRUMENT_REGION();
+
+    budget_start_tick = getTickCount();
+    CV_Assert(!nextFrame.empty() && nextFrame.depth() == CV_8U && isSupportedChannels(nextFrame.channels()));
+
+    Mat I1Mat = nextFrame.getMat();
+    int roi_mode = static_tile_threshold > 0 ? ROI_STATIC_TILES : ROI_NONE;
+    use_roi_mask = use_static_tiles = false;
+    skipped_fraction = 0.0f;
+    bool use_input_flow = false;
+    if (flow.sameSize(nextFrame) && flow.depth() == CV_32F && flow.channels() == 2)
+        use_input_flow = true;
+    else
+        flow.create(I1Mat.size(), CV_32FC2);
+    Mat flowMat = flow.getMat();
+    selectScales(I1Mat.size());
+
+    /* Restart the stream if the frame size or any parameter that affects the buffers has changed */
+    if (allocateBuffers(I1Mat.size(), use_input_flow || use_temporal_warm_start, true, roi_mode))
+        stream_ready = false;
+
+    Mat empty;
+    bool flow_computed = stream_ready;
+    if (!stream_ready)
+    {
+        /* First frame of the stream: there is nothing to compute the flow against yet */
+        prepareBuffers(empty, I1Mat, flowMat, false, true);
+        flowMat.setTo(0.0f);
+        warm_start_ready = false;
+        prev_max_motion = -1.0f;
+    }
+    else
+    {
+        std::swap(I0s, I1s);
+        std::swap(I0xs, I1xs);
+        std::swap(I0ys, I1ys);
+        std::swap(I0_tensors, I1_tensors);
+        prepareBuffers(empty, I1Mat, flowMat, use_input_flow, true);
+        /* An explicitly passed initial flow takes precedence over the warm start */
+        if (!use_input_flow && use_temporal_warm_start && warm_start_ready)
+            use_initial_flow = true;
+        if (roi_mode == ROI_STATIC_TILES)
+        {
+            detectStaticTiles();
+            use_roi_mask = use_static_tiles = true;
+        }
+        if (use_adaptive_coarsest_scale)
+            search_coarsest_scale = adaptiveCoarsestScale();
+        computeFlow(flowMat, true);
+        if (use_temporal_warm_start)
+            prepareWarmStart();
+        if (use_adaptive_coarsest_scale)
+            updateMotionStatistics();
+    }
+
+    prepareNextFrame();
+    stream_ready = true;
+    if (flow_computed)
+        post_pass_ms = (getTickCount() - levels_end_tick) * 1000.0 / getTickFrequency();
+}
+
+void DISOpticalFlowImpl::collectGarbage()
+{
+    CV_INSTRUMENT_REGION();
+
+    I0s.clear();
+    I1s.clear();
+    I0xs.clear();
+    I0ys.clear();
+    Ux.clear();
+    Uy.clear();
+    upscale_xofs.release();
+    upscale_alpha.release();
+    roi_integral.release();
+    patch_mask.release();
+    I1xs.clear();
+    I1ys.clear();
+    I0_tensors.clear();
+    I1_tensors.clear();
+    finest_bufs[0].release();
+    finest_bufs[1].release();
+    finest_external = false;
+    stream_ready = false;
+    Sx.release();
+    Sy.release();
+    Sx_init.release();
+    Sy_init.release();
+    I0xx_buf.release();
+    I0yy_buf.release();
+    I0xy_buf.release();
+    I0x_buf.release();
+    I0y_buf.release();
+    I0xx_buf_aux.release();
+    I0yy_buf_aux.release();
+    I0xy_buf_aux.release();
+    I0x_buf_aux.release();
+    I0y_buf_aux.release();
+    initial_Ux.clear();
+    initial_Uy.clear();
+    flow_uv[0].release();
+    flow_uv[1].release();
+    buffers_arena.release();
+
+    for (int i = finest_scale; i <= coarsest_scale; i++)
+        variational_refinement_processors[i]->collectGarbage();
+    variational_refinement_processors.clear();
+}
+
+Ptr<DISOpticalFlow> DISOpticalFlow::create(int preset)
+{
+    CV_INSTRUMENT_REGION();
+
+    Ptr<DISOpticalFlow> dis = makePtr<DISOpticalFlowImpl>();
+    dis->setPatchSize(8);
+    if (preset == DISOpticalFlow::PRESET_ULTRAFAST)
+    {
+        dis->setFinestScale(2);
+        dis->setPatchStride(4);
+        dis->setGradientDescentIterations(12);
+        dis->setVariationalRefinementIterations(0);
+    }
+    else if (preset == DISOpticalFlow::PRESET_FAST)
+    {
+        dis->setFinestScale(2);
+        dis->setPatchStride(4);
+        dis->setGradientDescentIterations(16);
+        dis->setVariationalRefinementIterations(5);
+    }
+    else if (preset == DISOpticalFlow::PRESET_MEDIUM)
+    {
+        dis->setFinestScale(1);
+        dis->setPatchStride(3);
+        dis->setGradientDescentIterations(25);
+        dis->setVariationalRefinementIterations(5);
+    }
+
+    return dis;
+}
 
 } // namespace